@@ -1,5 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS and MAP_NORESERVE */
+
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include <editline/readline.h>
 #include "mpc.h"
@@ -17,9 +37,9 @@
   }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, LPTR(args->cell[index])->type == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype2name(args->cell[index]->type), ltype2name(expect))
+    func, index, ltype2name(LPTR(args->cell[index])->type), ltype2name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
@@ -27,29 +47,92 @@
     func, args->count, num)
 
 #define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
+  LASSERT(args, LPTR(args->cell[index])->count != 0, \
     "Function '%s' passed empty argument %i.", func, index);
 
 /* Types */
 
 struct lval;
 struct lenv;
+struct lchan;
+struct ldata;
+struct lseq;
+struct lsock;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lchan lchan;
+typedef struct ldata ldata;
+typedef struct lseq lseq;
+typedef struct lsock lsock;
+
+/* Cells and env slots hold references, 32 bit heap offsets when compressed */
+#ifdef LVAL_COMPRESSED
+typedef uint32_t lref;
+#define LREF(v) ((lref)(((char*)(v) - heap.base) >> 3))
+#define LPTR(r) ((lval*)(heap.base + ((size_t)(r) << 3)))
+#else
+typedef lval* lref;
+#define LREF(v) (v)
+#define LPTR(r) (r)
+#endif
 
 enum { 
   LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN,
-  LVAL_SEXPR, LVAL_QEXPR 
+  LVAL_SEXPR, LVAL_QEXPR, LVAL_CHAN, LVAL_STR, LVAL_DATA,
+  LVAL_SEQ, LVAL_SOCK
 };
 
 typedef lval*(*lbuiltin) (lenv*, lval*);
 
+/* Names up to 15 bytes are kept inline and zero padded, longer ones */
+/* on the heap with the last byte set, see Names */
+enum { LNAME_SIZE = 16 };
+
+typedef union {
+  char buf[LNAME_SIZE];
+  uint64_t words[LNAME_SIZE / 8];
+  char* ptr;
+} lname;
+
+/* A builtin's slot in the static table, see Builtin table */
+enum { LBUILTIN_BITS = 7 };
+
+typedef struct {
+  lname name;
+  lbuiltin func;
+  int shadowed;
+} lbuiltin_slot;
+
+/* Expressions of up to this many cells keep them inside the lval */
+enum { LVAL_SMALL = 4 };
+
+/* Longer ones keep them in a block shared by their copies, see lval_own */
+typedef struct {
+  int refs;
+  lref items[];
+} lcells;
+
+#define LCELLS(cell) ((lcells*)((char*)(cell) - offsetof(lcells, items)))
+
+/* An error keeps its format and the arguments it was given, and is */
+/* only formatted when printed or caught, see lerr_format */
+enum { LERR_ARGS = 6 };
+
+typedef struct {
+  size_t size;
+  union { long num; size_t off; } args[LERR_ARGS]; /* strings as offsets into strs */
+  char strs[];
+} lerr;
+
 struct lval {
   int type;
 
-  char* err;
+  char* err; /* the format, see lerr */
+  lerr* args;
+  lval* thrown;
   long num;
-  char* sym;
+  lname sym;
+  char* str;
 
   lbuiltin builtin;
   lenv* env;
@@ -57,28 +140,342 @@ struct lval {
   lval* body;
 
   int count;
-  lval** cell;
+  lref* cell;
+  lref small[LVAL_SMALL]; /* cell points here while they fit */
+
+  lchan* chan;
+
+  ldata* data;
+  size_t off;
+
+  lseq* seq;
+
+  lsock* sock;
 };
 
 struct lenv {
   lenv* parent;
+  int shared; /* read only to def, see lenv_global_put */
+  int count;
+  int slots;
+  lname* syms;
+  lref* vals;
+};
+
+/* Channels are shared by reference, see Tasks */
+typedef struct ltask ltask;
+
+struct lchan {
+  int refs;
+  pthread_mutex_t lock;
   int count;
-  char** syms;
+  int first;
+  int slots;
   lval** vals;
+  int waiters_num;
+  ltask** waiters;
+};
+
+/* A mapped data image, shared by the values pointing into it */
+struct ldata {
+  int refs;
+  char* base;
+  size_t size;
+};
+
+/* A lazy sequence stage, shared by the values holding it */
+struct lseq {
+  int refs;
+  int kind;
+  lseq* src;
+  lval* f;
+  lval* x;
+  long from;
+  long to;
+  long step;
+};
+
+/* An open socket, shared by the values holding it, see Io */
+struct lsock {
+  int refs;
+  int fd;
 };
 
+/* Limits */
+
+/* Every top level evaluation runs on a budget of eval steps, live */
+/* lval bytes (values, their cell arrays and strings) and wall clock */
+/* time, zero meaning no limit. The counters are per thread so server */
+/* workers keep their own. Once a limit trips, every lval_eval */
+/* returns an error straight away, which unwinds the evaluation. */
+
+typedef struct {
+  long steps;
+  long bytes;
+  long millis;
+} llimits;
+
+llimits limits = { 0, 0, 0 };
+
+enum { LBUDGET_OK, LBUDGET_STEPS, LBUDGET_BYTES, LBUDGET_TIME, LBUDGET_CANCEL };
+
+typedef struct {
+  long ticks;
+  long steps;
+  long bytes;
+  long bytes_start;
+  struct timespec deadline;
+  int tripped;
+} lbudget;
+
+__thread lbudget budget;
+
+void lbudget_start(void) {
+  budget.steps = 0;
+  budget.bytes_start = budget.bytes;
+  budget.tripped = LBUDGET_OK;
+  clock_gettime(CLOCK_MONOTONIC, &budget.deadline);
+  budget.deadline.tv_sec += limits.millis / 1000;
+  budget.deadline.tv_nsec += (limits.millis % 1000) * 1000000;
+  if (budget.deadline.tv_nsec >= 1000000000) {
+    budget.deadline.tv_sec++;
+    budget.deadline.tv_nsec -= 1000000000;
+  }
+}
+
+/* Looks at the clock every 1024 steps or allocations */
+void lbudget_tick(void) {
+  struct timespec now;
+  if (!limits.millis || budget.tripped || (++budget.ticks & 1023)) { return; }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > budget.deadline.tv_sec
+  || (now.tv_sec == budget.deadline.tv_sec && now.tv_nsec >= budget.deadline.tv_nsec)) {
+    budget.tripped = LBUDGET_TIME;
+  }
+}
+
+void lbudget_alloc(long n) {
+  budget.bytes += n;
+  if (n <= 0) { return; }
+  if (limits.bytes && !budget.tripped
+  &&  budget.bytes - budget.bytes_start > limits.bytes) {
+    budget.tripped = LBUDGET_BYTES;
+  }
+  lbudget_tick();
+}
+
+/* Milliseconds left before the time limit, -1 when there is none */
+int lbudget_millis_left(void) {
+  struct timespec now;
+  if (!limits.millis) { return -1; }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long ms = (budget.deadline.tv_sec - now.tv_sec) * 1000
+          + (budget.deadline.tv_nsec - now.tv_nsec) / 1000000;
+  return ms > 0 ? (int)ms : 0;
+}
+
+/* Heap */
+
+/* Values and envs are carved out of 2MB chunks, one arena for each, */
+/* and freed nodes are threaded through their first word. With */
+/* --huge-pages a chunk is backed by an explicit huge page when the */
+/* system has some reserved and is advised as a transparent one */
+/* otherwise. The compressed build takes its chunks from one reserved */
+/* region of 32GB, so an offset in 8 byte units fits in 32 bits. */
+
+#define LHEAP_CHUNK ((size_t)2 << 20)
+#define LHEAP_SIZE ((size_t)1 << 35)
+
+typedef struct {
+  size_t size;
+  char* next;
+  char* end;
+  void* free;
+} larena;
+
+typedef struct {
+  int huge;
+  long chunks;
+  long huge_chunks;
+  char* base;
+  size_t top;
+  pthread_mutex_t lock;
+  larena vals;
+  larena envs;
+} lheap;
+
+lheap heap;
+
+void lheap_init(void) {
+  pthread_mutex_init(&heap.lock, NULL);
+  heap.vals.size = (sizeof(lval) + 7) & ~(size_t)7;
+  heap.envs.size = (sizeof(lenv) + 7) & ~(size_t)7;
+#ifdef LVAL_COMPRESSED
+  /* Pages are only committed once touched */
+  char* p = mmap(NULL, LHEAP_SIZE + LHEAP_CHUNK, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  heap.base = (char*)(((uintptr_t)p + LHEAP_CHUNK - 1) & ~(uintptr_t)(LHEAP_CHUNK - 1));
+  /* The first chunk stays unused so offset 0 is never handed out */
+  heap.top = LHEAP_CHUNK;
+#endif
+}
+
+/* Maps one chunk at the given address, or anywhere on a 2MB boundary */
+char* lheap_map(char* at) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | (at ? MAP_FIXED : 0);
+  char* p;
+#ifdef MAP_HUGETLB
+  if (heap.huge) {
+    p = mmap(at, LHEAP_CHUNK, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      heap.huge_chunks++;
+      return p;
+    }
+  }
+#endif
+  if (at) {
+    p = mmap(at, LHEAP_CHUNK, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) { return NULL; }
+  } else {
+    /* Map twice the size and trim both ends to get the alignment */
+    char* m = mmap(NULL, 2 * LHEAP_CHUNK, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (m == MAP_FAILED) { return NULL; }
+    p = (char*)(((uintptr_t)m + LHEAP_CHUNK - 1) & ~(uintptr_t)(LHEAP_CHUNK - 1));
+    if (p > m) { munmap(m, p - m); }
+    if (p < m + LHEAP_CHUNK) { munmap(p + LHEAP_CHUNK, m + LHEAP_CHUNK - p); }
+  }
+#ifdef MADV_HUGEPAGE
+  if (heap.huge) { madvise(p, LHEAP_CHUNK, MADV_HUGEPAGE); }
+#endif
+  return p;
+}
+
+char* lheap_chunk(void) {
+#ifdef LVAL_COMPRESSED
+  if (heap.top + LHEAP_CHUNK > LHEAP_SIZE) { return NULL; }
+  char* p = lheap_map(heap.base + heap.top);
+  heap.top += LHEAP_CHUNK;
+#else
+  char* p = lheap_map(NULL);
+#endif
+  if (p) { heap.chunks++; }
+  return p;
+}
+
+/* Takes the next node of an arena, the heap lock must be held */
+void* larena_next(larena* a) {
+  void* p;
+  if (a->free) {
+    p = a->free;
+    a->free = *(void**)p;
+    return p;
+  }
+  if ((size_t)(a->end - a->next) < a->size) {
+    char* c = lheap_chunk();
+    if (!c) {
+      fprintf(stderr, "Heap exhausted.\n");
+      abort();
+    }
+    a->next = c;
+    a->end = c + LHEAP_CHUNK;
+  }
+  p = a->next;
+  a->next += a->size;
+  return p;
+}
+
+/* Each thread keeps its own free list in front of every arena and */
+/* only takes the heap lock to move a batch of nodes in or out of it. */
+
+enum { LCACHE_BATCH = 64 };
+
+typedef struct {
+  void* free;
+  int num;
+} lcache;
+
+__thread lcache val_cache;
+__thread lcache env_cache;
+
+void* lcache_alloc(lcache* c, larena* a) {
+  if (!c->free) {
+    pthread_mutex_lock(&heap.lock);
+    UPTO(LCACHE_BATCH) {
+      void* p = larena_next(a);
+      *(void**)p = c->free;
+      c->free = p;
+    }
+    pthread_mutex_unlock(&heap.lock);
+    c->num += LCACHE_BATCH;
+  }
+  void* p = c->free;
+  c->free = *(void**)p;
+  c->num--;
+  return p;
+}
+
+/* Hands n cached nodes back to the arena, all of them when n is -1 */
+void lcache_return(lcache* c, larena* a, int n) {
+  if (!c->free || n == 0) { return; }
+  if (n < 0 || n > c->num) { n = c->num; }
+  void* first = c->free;
+  void* last = first;
+  for (int i = 1; i < n; i++) { last = *(void**)last; }
+  c->free = *(void**)last;
+  c->num -= n;
+  pthread_mutex_lock(&heap.lock);
+  *(void**)last = a->free;
+  a->free = first;
+  pthread_mutex_unlock(&heap.lock);
+}
+
+void lcache_release(lcache* c, larena* a, void* p) {
+  *(void**)p = c->free;
+  c->free = p;
+  if (++c->num >= 2 * LCACHE_BATCH) { lcache_return(c, a, LCACHE_BATCH); }
+}
+
+/* Gives the nodes cached by this thread back to the heap */
+void lheap_flush(void) {
+  lcache_return(&val_cache, &heap.vals, -1);
+  lcache_return(&env_cache, &heap.envs, -1);
+}
+
+lval* lval_alloc(void) { return lcache_alloc(&val_cache, &heap.vals); }
+void lval_release(lval* v) { lcache_release(&val_cache, &heap.vals, v); }
+
 /* Function signatures */
 /* Only the mandatory ones with cross-references */
 
 void lval_free(lval* v);
-void lval_print(lval* v);
+void lval_print_to(lval* v, FILE* f);
 lval* lval_eval(lenv* e, lval* v);
+int ltask_stack_low(void);
+lval* lval_copy(lval* v);
 lenv* lenv_new(void);
+lenv* lenv_alloc(int slots);
 lenv* lenv_copy(lenv* e);
 void lenv_free(lenv* e);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_bind(lenv* e, lval* k, lval* v);
+lval* lval_chan(void);
+void lchan_free(lchan* c);
+void lsock_free(lsock* s);
+int lchan_unwait(lchan* c, ltask* t);
+void ldata_free(ldata* m);
+lval* lval_data(ldata* m, size_t off);
+lval* lval_data_expand(lval* v);
+int lval_data_sexpr(lval* v);
+void lval_force(lval* a);
+void lseq_free(lseq* s);
+int lseq_open(lseq* s);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
+lbuiltin_slot* lbuiltin_find(lname* n);
 
 /* Helpers */
 
@@ -90,14 +487,58 @@ char* ltype2name(int t) {
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_CHAN: return "Channel";
+    case LVAL_STR: return "String";
+    case LVAL_DATA: return "Q-Expression";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_SOCK: return "Socket";
     default: return "Unknown";
   }
 }
 
+/* Names */
+
+void lname_set(lname* n, const char* s) {
+  size_t len = strlen(s);
+  memset(n, 0, sizeof(lname));
+  if (len < LNAME_SIZE) {
+    memcpy(n->buf, s, len);
+    return;
+  }
+  n->ptr = malloc(len+1);
+  strcpy(n->ptr, s);
+  n->buf[LNAME_SIZE-1] = 1;
+}
+
+char* lname_str(lname* n) {
+  return n->buf[LNAME_SIZE-1] ? n->ptr : n->buf;
+}
+
+/* Inline names are equal when their words are, a long one never */
+/* equals an inline one */
+int lname_eq(lname* a, lname* b) {
+  if (a->words[0] == b->words[0] && a->words[1] == b->words[1]) { return 1; }
+  return a->buf[LNAME_SIZE-1] && b->buf[LNAME_SIZE-1]
+    && strcmp(a->ptr, b->ptr) == 0;
+}
+
+void lname_copy(lname* dst, lname* src) {
+  if (src->buf[LNAME_SIZE-1]) {
+    lname_set(dst, src->ptr);
+  } else {
+    *dst = *src;
+  }
+}
+
+void lname_free(lname* n) {
+  if (n->buf[LNAME_SIZE-1]) { free(n->ptr); }
+}
+
 /* Lisp value constructors */
 
 lval* lval_new(int type) {
-  lval* v = malloc(sizeof(lval));
+  lval* v = lval_alloc();
+  lbudget_alloc(sizeof(lval));
   v->type = type;
   return v;
 }
@@ -108,21 +549,145 @@ lval* lval_num(long x) {
   return v;
 }
 
+/* Length of the conversion at the % in s, e.g. 3 for "%li" */
+size_t lerr_spec(char* s) {
+  return 2 + strspn(s + 1, "-+ #0123456789.*hl");
+}
+
+/* Only the arguments are kept, strings copied as they may not outlive */
+/* the error */
 lval* lval_err(char* fmt, ...) {
   lval* v = lval_new(LVAL_ERR);
+  v->err = fmt;
+  v->args = NULL;
+  v->thrown = NULL;
+  if (!strchr(fmt, '%')) { return v; }
+
+  long nums[LERR_ARGS];
+  char* strs[LERR_ARGS];
+  size_t lens[LERR_ARGS];
+  size_t size = 0;
+  int count = 0;
+  int prec = -1;
+
   va_list va;
   va_start(va, fmt);
-  v->err = malloc(512);
-  vsnprintf(v->err, 511, fmt, va);
-  v->err = realloc(v->err, strlen(v->err)+1);
+  char* s = fmt;
+  while ((s = strchr(s, '%'))) {
+    size_t n = lerr_spec(s);
+    char c = s[n-1];
+    int star = memchr(s, '*', n) != NULL;
+    int wide = memchr(s, 'l', n) != NULL;
+    s += n;
+    if (c == '%') { continue; }
+    if (star) {
+      prec = va_arg(va, int);
+      strs[count] = NULL;
+      nums[count++] = prec;
+    }
+    if (c == 's') {
+      strs[count] = va_arg(va, char*);
+      lens[count] = star && prec >= 0 ? strnlen(strs[count], prec) : strlen(strs[count]);
+      size += lens[count] + 1;
+    } else {
+      strs[count] = NULL;
+      nums[count] = wide ? va_arg(va, long) : va_arg(va, int);
+    }
+    count++;
+  }
   va_end(va);
+
+  v->args = malloc(sizeof(lerr) + size);
+  v->args->size = sizeof(lerr) + size;
+  size_t off = 0;
+  UPTO(count) {
+    if (strs[i]) {
+      memcpy(v->args->strs + off, strs[i], lens[i]);
+      v->args->strs[off + lens[i]] = '\0';
+      v->args->args[i].off = off;
+      off += lens[i] + 1;
+    } else {
+      v->args->args[i].num = nums[i];
+    }
+  }
+  return v;
+}
+
+/* Appends n bytes to a message as far as it fits, see lerr_write */
+size_t lerr_put(char* buf, size_t size, size_t len, char* s, size_t n) {
+  if (len < size) { memcpy(buf + len, s, len + n < size ? n : size - len); }
+  return len + n;
+}
+
+/* Writes an error's message into buf as far as it fits, returning its */
+/* full length. Strings were cut to their precision when kept. */
+size_t lerr_write(lval* v, char* buf, size_t size) {
+  size_t len = 0;
+  int a = 0;
+  char* s = v->err;
+  while (*s) {
+    size_t n = strcspn(s, "%");
+    if (n > 0) {
+      len = lerr_put(buf, size, len, s, n);
+      s += n;
+      continue;
+    }
+    n = lerr_spec(s);
+    char c = s[n-1];
+    if (c == '%') {
+      len = lerr_put(buf, size, len, "%", 1);
+    } else if (c == 's') {
+      if (memchr(s, '*', n)) { a++; }
+      char* str = v->args->strs + v->args->args[a++].off;
+      len = lerr_put(buf, size, len, str, strlen(str));
+    } else {
+      char spec[16];
+      char num[32];
+      memcpy(spec, s, n);
+      spec[n] = '\0';
+      long x = v->args->args[a++].num;
+      int k = memchr(s, 'l', n) ? snprintf(num, sizeof(num), spec, x)
+        : snprintf(num, sizeof(num), spec, (int)x);
+      len = lerr_put(buf, size, len, num, k < (int)sizeof(num) ? k : sizeof(num) - 1);
+    }
+    s += n;
+  }
+  return len;
+}
+
+char* lerr_format(lval* v) {
+  char buf[256];
+  size_t len = lerr_write(v, buf, sizeof(buf));
+  char* msg = malloc(len + 1);
+  if (len < sizeof(buf)) {
+    memcpy(msg, buf, len);
+  } else {
+    lerr_write(v, msg, len);
+  }
+  msg[len] = '\0';
+  return msg;
+}
+
+/* Thrown values are kept as they are, never formatted unless printed */
+lval* lval_throw(lval* x) {
+  lval* v = lval_new(LVAL_ERR);
+  v->err = NULL;
+  v->args = NULL;
+  v->thrown = x;
   return v;
 }
 
 lval* lval_sym(char* s) {
   lval* v = lval_new(LVAL_SYM);
-  v->sym = malloc(strlen(s)+1);
-  strcpy(v->sym, s);
+  lname_set(&v->sym, s);
+  return v;
+}
+
+lval* lval_str(char* s) {
+  lval* v = lval_new(LVAL_STR);
+  v->str = malloc(strlen(s)+1);
+  lbudget_alloc(strlen(s)+1);
+  strcpy(v->str, s);
   return v;
 }
 
@@ -135,7 +700,7 @@ lval* lval_fun(lbuiltin func) {
 lval* lval_lambda(lval* formals, lval* body) {
   lval* v = lval_new(LVAL_FUN);
   v->builtin = NULL;
-  v->env = lenv_new();
+  v->env = lenv_alloc(formals->count);
   v->formals = formals;
   v->body = body;
   return v;
@@ -144,31 +709,80 @@ lval* lval_lambda(lval* formals, lval* body) {
 lval* lval_sexpr(void) {
   lval* v = lval_new(LVAL_SEXPR);
   v->count = 0;
-  v->cell = NULL;
+  v->cell = v->small;
   return v;
 }
 
 lval* lval_qexpr(void) {
   lval* v = lval_new(LVAL_QEXPR);
   v->count = 0;
-  v->cell = NULL;
+  v->cell = v->small;
   return v;
 }
 
 /* Lisp value functions */
 
+lref* lcells_new(int n) {
+  lcells* c = malloc(sizeof(lcells) + sizeof(lref) * n);
+  c->refs = 1;
+  return c->items;
+}
+
+/* The values go with the last reference to the block */
+void lcells_free(lref* cell, int count) {
+  lcells* c = LCELLS(cell);
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+  UPTO(count) { lval_free(LPTR(cell[i])); }
+  free(c);
+}
+
+/* Copies of an expression share its cell block, so copying a list or */
+/* a function body costs nothing until one of them changes. Anything */
+/* writing to v->cell or taking values out of it calls this first, */
+/* which gives v cells of its own, copied one level deep. */
+void lval_own(lval* v) {
+  if (v->cell == v->small) { return; }
+  if (__atomic_load_n(&LCELLS(v->cell)->refs, __ATOMIC_ACQUIRE) == 1) { return; }
+  lref* cell = v->count <= LVAL_SMALL ? v->small : lcells_new(v->count);
+  UPTO(v->count) { cell[i] = LREF(lval_copy(LPTR(v->cell[i]))); }
+  lcells_free(v->cell, v->count);
+  v->cell = cell;
+}
+
+/* Makes room for n cells, keeping the first ones up to v->count */
+void lval_resize(lval* v, int n) {
+  lval_own(v);
+  if (n <= LVAL_SMALL) {
+    if (v->cell != v->small) {
+      memcpy(v->small, v->cell, sizeof(lref) * (v->count < n ? v->count : n));
+      free(LCELLS(v->cell));
+      v->cell = v->small;
+    }
+  } else if (v->cell == v->small) {
+    lref* cell = lcells_new(n);
+    memcpy(cell, v->small, sizeof(lref) * v->count);
+    v->cell = cell;
+  } else {
+    lcells* c = realloc(LCELLS(v->cell), sizeof(lcells) + sizeof(lref) * n);
+    v->cell = c->items;
+  }
+}
+
 lval* lval_add(lval* v, lval* x) {
+  lval_resize(v, v->count+1);
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count-1] = x;
+  lbudget_alloc(sizeof(lref));
+  v->cell[v->count-1] = LREF(x);
   return v;
 }
 
 lval* lval_pop(lval* v, int i) {
-  lval* x = v->cell[i];
-  memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+  lval_own(v);
+  lval* x = LPTR(v->cell[i]);
+  memmove(&v->cell[i], &v->cell[i+1], sizeof(lref) * (v->count-i-1));
   v->count--;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  lval_resize(v, v->count);
+  lbudget_alloc(-(long)sizeof(lref));
   return x;
 }
 
@@ -195,21 +809,58 @@ lval* lval_copy(lval* v) {
     break;
     
     case LVAL_ERR:
-      x->err = malloc(strlen(v->err)+1);
-      strcpy(x->err, v->err);
+      x->err = v->err;
+      x->args = NULL;
+      x->thrown = v->thrown ? lval_copy(v->thrown) : NULL;
+      if (v->args) {
+        x->args = malloc(v->args->size);
+        memcpy(x->args, v->args, v->args->size);
+      }
     break;
 
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym)+1);
-      strcpy(x->sym, v->sym);
+      lname_copy(&x->sym, &v->sym);
+    break;
+
+    case LVAL_STR:
+      x->str = malloc(strlen(v->str)+1);
+      lbudget_alloc(strlen(v->str)+1);
+      strcpy(x->str, v->str);
+    break;
+
+    case LVAL_CHAN:
+      x->chan = v->chan;
+      __atomic_add_fetch(&x->chan->refs, 1, __ATOMIC_RELAXED);
+    break;
+
+    case LVAL_DATA:
+      x->data = v->data;
+      x->off = v->off;
+      __atomic_add_fetch(&x->data->refs, 1, __ATOMIC_RELAXED);
+    break;
+
+    case LVAL_SEQ:
+      x->seq = v->seq;
+      __atomic_add_fetch(&x->seq->refs, 1, __ATOMIC_RELAXED);
+    break;
+
+    case LVAL_SOCK:
+      x->sock = v->sock;
+      __atomic_add_fetch(&x->sock->refs, 1, __ATOMIC_RELAXED);
     break;
 
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      lbudget_alloc(sizeof(lref) * x->count);
+      if (v->cell != v->small) {
+        x->cell = v->cell;
+        __atomic_add_fetch(&LCELLS(x->cell)->refs, 1, __ATOMIC_RELAXED);
+        break;
+      }
+      x->cell = x->small;
       UPTO(x->count) {
-        x->cell[i] = lval_copy(v->cell[i]);
+        x->cell[i] = LREF(lval_copy(LPTR(v->cell[i])));
       }
     break;
 
@@ -221,8 +872,19 @@ lval* lval_copy(lval* v) {
 void lval_free(lval* v) {
   switch (v->type) {
     case LVAL_NUM: break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
+    case LVAL_ERR:
+      free(v->args);
+      if (v->thrown) { lval_free(v->thrown); }
+    break;
+    case LVAL_SYM: lname_free(&v->sym); break;
+    case LVAL_CHAN: lchan_free(v->chan); break;
+    case LVAL_DATA: ldata_free(v->data); break;
+    case LVAL_SEQ: lseq_free(v->seq); break;
+    case LVAL_SOCK: lsock_free(v->sock); break;
+    case LVAL_STR:
+      lbudget_alloc(-(long)strlen(v->str)-1);
+      free(v->str);
+    break;
     case LVAL_FUN: 
       if (!v->builtin) {
         lenv_free(v->env);
@@ -232,19 +894,25 @@ void lval_free(lval* v) {
     break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-      UPTO(v->count) {
-        lval_free(v->cell[i]);
+      if (v->cell != v->small) {
+        lcells_free(v->cell, v->count);
+      } else {
+        UPTO(v->count) { lval_free(LPTR(v->cell[i])); }
       }
-      free(v->cell);
+      lbudget_alloc(-(long)sizeof(lref) * v->count);
     break;
   }
-  free(v);
+  lval_release(v);
+  lbudget_alloc(-(long)sizeof(lval));
 }
 
 lval* lval_join(lval* x, lval* y) {
-  while (y->count) {
-    x = lval_add(x, lval_pop(y,0));
-  }
+  /* Move the cells over in one go, popping them one by one is quadratic */
+  lval_own(y);
+  lval_resize(x, x->count + y->count);
+  memcpy(&x->cell[x->count], y->cell, sizeof(lref) * y->count);
+  x->count += y->count;
+  y->count = 0;
   lval_free(y);
   return x;
 }
@@ -262,7 +930,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     }
 
     lval* sym = lval_pop(f->formals, 0);
-    if (strcmp(sym->sym, "&") == 0) {
+    if (strcmp(lname_str(&sym->sym), "&") == 0) {
       if (f->formals->count != 1) {
         lval_free(a);
         return lval_err("Function format invalid. Symbol `&` not followed by single symbol.");
@@ -274,15 +942,13 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     }
 
     lval* val = lval_pop(a, 0);
-    
-    lenv_put(f->env, sym, val);
-    lval_free(sym); lval_free(val);
+    lenv_bind(f->env, sym, val);
   }
 
   lval_free(a);
 
   if (f->formals->count > 0 &&
-      strcmp(f->formals->cell[0]->sym, "&") == 0) {
+      strcmp(lname_str(&LPTR(f->formals->cell[0])->sym), "&") == 0) {
     if (f->formals->count != 2) {
       return lval_err("Function format invalid. Symbol `&` not followed by single symbol.");
     }
@@ -303,183 +969,348 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 /* Env contructor */
 
-lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+/* Freed envs are kept per thread by capacity and handed out again, */
+/* so a lambda call gets a frame with room for its arguments without */
+/* touching malloc. The lists are linked through parent. */
+
+enum { LENV_POOL_SLOTS = 8, LENV_POOL_KEEP = 256 };
+
+typedef struct {
+  int num[LENV_POOL_SLOTS + 1];
+  lenv* free[LENV_POOL_SLOTS + 1];
+} lpool;
+
+__thread lpool pool;
+
+lenv* lenv_alloc(int slots) {
+  lenv* e;
+  if (slots <= LENV_POOL_SLOTS && pool.free[slots]) {
+    e = pool.free[slots];
+    pool.free[slots] = e->parent;
+    pool.num[slots]--;
+  } else {
+    e = lcache_alloc(&env_cache, &heap.envs);
+    e->slots = slots;
+    e->syms = slots ? malloc(sizeof(lname) * slots) : NULL;
+    e->vals = slots ? malloc(sizeof(lref) * slots) : NULL;
+  }
   e->parent = NULL;
+  e->shared = 0;
   e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
   return e;
 }
 
+lenv* lenv_new(void) {
+  return lenv_alloc(0);
+}
+
 void lenv_free(lenv* e) {
   UPTO(e->count) {
-    free(e->syms[i]);
-    lval_free(e->vals[i]);
+    lname_free(&e->syms[i]);
+    lval_free(LPTR(e->vals[i]));
+  }
+  if (e->slots <= LENV_POOL_SLOTS && pool.num[e->slots] < LENV_POOL_KEEP) {
+    e->parent = pool.free[e->slots];
+    pool.free[e->slots] = e;
+    pool.num[e->slots]++;
+    return;
   }
   free(e->syms);
   free(e->vals);
-  free(e);
+  lcache_release(&env_cache, &heap.envs, e);
+}
+
+/* Releases the envs kept by this thread */
+void lenv_pool_clear(void) {
+  for (int i = 0; i <= LENV_POOL_SLOTS; i++) {
+    while (pool.free[i]) {
+      lenv* e = pool.free[i];
+      pool.free[i] = e->parent;
+      free(e->syms);
+      free(e->vals);
+      lcache_release(&env_cache, &heap.envs, e);
+    }
+    pool.num[i] = 0;
+  }
 }
 
 /* Env functions */
 
 lval* lenv_get(lenv* e, lval* k) {
-  UPTO(e->count) {
-    if (strcmp(e->syms[i], k->sym)==0) {
-      return lval_copy(e->vals[i]);
-    }
+  lbuiltin_slot* b = lbuiltin_find(&k->sym);
+  if (b && !__atomic_load_n(&b->shadowed, __ATOMIC_RELAXED)) {
+    return lval_fun(b->func);
   }
-  if (e->parent) {
-    return lenv_get(e->parent, k);
-  } else {
-    return lval_err("Unknown symbol '%s' !", k->sym);
+  for (; e; e = e->parent) {
+    UPTO(e->count) {
+      if (lname_eq(&e->syms[i], &k->sym)) {
+        return lval_copy(LPTR(e->vals[i]));
+      }
+    }
   }
+  if (b) { return lval_fun(b->func); }
+  return lval_err("Unknown symbol '%s' !", lname_str(&k->sym));
+}
+
+/* Names defined anywhere take precedence over the builtin from now on */
+void lenv_shadow(lval* k) {
+  lbuiltin_slot* b = lbuiltin_find(&k->sym);
+  if (b) { __atomic_store_n(&b->shadowed, 1, __ATOMIC_RELAXED); }
+}
+
+void lenv_grow(lenv* e) {
+  if (e->count < e->slots) { return; }
+  e->slots = e->slots ? e->slots * 2 : 4;
+  e->vals = realloc(e->vals, sizeof(lref) * e->slots);
+  e->syms = realloc(e->syms, sizeof(lname) * e->slots);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
   UPTO(e->count) {
-    if (strcmp(e->syms[i], k->sym)==0) {
-      lval_free(e->vals[i]);
-      e->vals[i] = lval_copy(v);
+    if (lname_eq(&e->syms[i], &k->sym)) {
+      lval_free(LPTR(e->vals[i]));
+      e->vals[i] = LREF(lval_copy(v));
       return;
     }
   }
+  lenv_grow(e);
+  lenv_shadow(k);
+  e->vals[e->count] = LREF(lval_copy(v));
+  lname_copy(&e->syms[e->count], &k->sym);
   e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-  e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count-1], k->sym);
 }
 
-void lenv_global_put(lenv* e, lval* k, lval* v) {
-  while (e->parent) { e = e->parent; }
-  lenv_put(e, k, v);
+/* Like lenv_put, but takes over the name and value instead of copying */
+void lenv_bind(lenv* e, lval* k, lval* v) {
+  UPTO(e->count) {
+    if (lname_eq(&e->syms[i], &k->sym)) {
+      lval_free(LPTR(e->vals[i]));
+      e->vals[i] = LREF(v);
+      lval_free(k);
+      return;
+    }
+  }
+  lenv_grow(e);
+  lenv_shadow(k);
+  e->vals[e->count] = LREF(v);
+  e->syms[e->count] = k->sym;
+  e->count++;
+  memset(&k->sym, 0, sizeof(lname));
+  lval_free(k);
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_fun(func);
+void lenv_global_put(lenv* e, lval* k, lval* v) {
+  while (e->parent && !e->parent->shared) { e = e->parent; }
   lenv_put(e, k, v);
-  lval_free(k); lval_free(v);
 }
 
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  lenv* n = lenv_alloc(e->slots);
   n->parent = e->parent;
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
   UPTO(e->count) {
-    n->syms[i] = malloc(strlen(e->syms[i])+1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+    lname_copy(&n->syms[i], &e->syms[i]);
+    n->vals[i] = LREF(lval_copy(LPTR(e->vals[i])));
   }
   return n;
 }
 
 /* Read */
 
-lval* lval_read_num(mpc_ast_t* t) {
+/* Values are built straight from the parser's visitor events, */
+/* with a stack of the rules we are in and the expressions open. */
+/* Syntax errors recovered by the parser are collected on the side. */
+
+typedef struct {
+  int count;
+  int slots;
+  const char** tags;
+  lval** exprs;
+  lval* result;
+  lval* errors;
+} lreader;
+
+lval* lval_read_num(const char* s) {
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
+  long x = strtol(s, NULL, 10);
   return errno!=ERANGE ?
     lval_num(x) : lval_err("Invalid number");
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number")) { 
-    return lval_read_num(t); 
-  }
-  if (strstr(t->tag, "symbol")) { 
-    return lval_sym(t->contents); 
+lval* lval_read_str(const char* s) {
+  /* Cut off the quotes and unescape what is between them */
+  char* unescaped = malloc(strlen(s)-1);
+  memcpy(unescaped, s+1, strlen(s)-2);
+  unescaped[strlen(s)-2] = '\0';
+  unescaped = mpcf_unescape(unescaped);
+  lval* x = lval_str(unescaped);
+  free(unescaped);
+  return x;
+}
+
+void lval_read_add(lreader* r, lval* x) {
+  for (int i = r->count-1; i >= 0; i--) {
+    if (r->exprs[i]) {
+      lval_add(r->exprs[i], x);
+      return;
+    }
   }
+  lval_free(x);
+}
 
+void lval_read_enter(void* d, const char* tag, mpc_state_t s) {
+  lreader* r = d;
   lval* x = NULL;
 
-  if (strcmp(t->tag, ">")==0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
-  UPTO(t->children_num) {
-    if (strcmp(t->children[i]->contents, "(")==0) {
-      continue;
-    }
-    if (strcmp(t->children[i]->contents, ")")==0) {
-      continue;
-    }
-    if (strcmp(t->children[i]->contents, "{")==0) {
-      continue;
-    }
-    if (strcmp(t->children[i]->contents, "}")==0) {
-      continue;
-    }
-    if (strcmp(t->children[i]->tag, "regex")==0) {
-      continue;
-    }
-    x = lval_add(x, lval_read(t->children[i]));
+  if (r->count==0) { x = lval_sexpr(); }
+  if (strcmp(tag, "sexpr")==0) { x = lval_sexpr(); }
+  if (strcmp(tag, "qexpr")==0) { x = lval_qexpr(); }
+
+  if (r->count==r->slots) {
+    r->slots = r->slots ? r->slots * 2 : 16;
+    r->tags = realloc(r->tags, sizeof(char*) * r->slots);
+    r->exprs = realloc(r->exprs, sizeof(lval*) * r->slots);
   }
+  r->tags[r->count] = tag;
+  r->exprs[r->count] = x;
+  r->count++;
+}
 
-  return x;
+void lval_read_leave(void* d, const char* tag) {
+  lreader* r = d;
+  lval* x = r->exprs[--r->count];
+  if (!x) { return; }
+  if (r->count==0) {
+    r->result = x;
+  } else {
+    lval_read_add(r, x);
+  }
+}
+
+void lval_read_terminal(void* d, const char* tag, const char* contents, mpc_state_t s) {
+  lreader* r = d;
+  const char* rule = r->tags[r->count-1];
+  if (strcmp(tag, "error")==0) {
+    lval_add(r->errors, lval_err("%.*s", (int)strcspn(contents, "\n"), contents));
+    return;
+  }
+  if (strcmp(rule, "number")==0) {
+    lval_read_add(r, lval_read_num(contents));
+  }
+  if (strcmp(rule, "symbol")==0) {
+    lval_read_add(r, lval_sym((char*)contents));
+  }
+  if (strcmp(rule, "string")==0) {
+    lval_read_add(r, lval_read_str(contents));
+  }
+}
+
+mpca_visitor_t lval_reader = {
+  lval_read_enter, lval_read_leave, lval_read_terminal
+};
+
+lval* lval_read(mpc_lexer_t* l, const char* filename, long row, const char* input, lval** errors, mpc_result_t* res) {
+  lreader r = { 0, 0, NULL, NULL, NULL, lval_qexpr() };
+  mpca_lex_visit_at(filename, row, input, l, &lval_reader, &r, res);
+  free(r.tags);
+  free(r.exprs);
+  *errors = r.errors;
+  return r.result;
 }
 
 /* Print */
 
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
+void lval_print_expr_to(lval* v, char open, char close, FILE* f) {
+  fputc(open, f);
   UPTO(v->count) {
-    lval_print(v->cell[i]);
+    lval_print_to(LPTR(v->cell[i]), f);
     if (i != (v->count - 1)) {
-      putchar(' ');
+      fputc(' ', f);
     }
   }
-  putchar(close);
+  fputc(close, f);
 }
 
-void lval_print(lval* v) {
+void lval_print_str_to(lval* v, FILE* f) {
+  char* escaped = malloc(strlen(v->str)+1);
+  strcpy(escaped, v->str);
+  escaped = mpcf_escape(escaped);
+  fprintf(f, "\"%s\"", escaped);
+  free(escaped);
+}
+
+void lval_print_to(lval* v, FILE* f) {
   switch (v->type) {
-    case LVAL_ERR: printf("Error: %s", v->err); break;
-    case LVAL_NUM: printf("%li", v->num); break;
-    case LVAL_SYM: printf("%s", v->sym); break;
+    case LVAL_ERR:
+      if (v->thrown) {
+        fprintf(f, "Error: ");
+        lval_print_to(v->thrown, f);
+      } else {
+        char* msg = lerr_format(v);
+        fprintf(f, "Error: %s", msg);
+        free(msg);
+      }
+    break;
+    case LVAL_NUM: fprintf(f, "%li", v->num); break;
+    case LVAL_SYM: fprintf(f, "%s", lname_str(&v->sym)); break;
     case LVAL_FUN: 
       if (v->builtin) {
-        printf("<builtin-function>");
+        fprintf(f, "<builtin-function>");
       } else {
-        printf("(fun ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        fprintf(f, "(fun ");
+        lval_print_to(v->formals, f);
+        fputc(' ', f);
+        lval_print_to(v->body, f);
+        fputc(')', f);
       }
     break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_SEXPR: lval_print_expr_to(v, '(', ')', f); break;
+    case LVAL_QEXPR: lval_print_expr_to(v, '{', '}', f); break;
+    case LVAL_CHAN: fprintf(f, "<channel>"); break;
+    case LVAL_SOCK: fprintf(f, "<socket>"); break;
+    case LVAL_SEQ: fprintf(f, lseq_open(v->seq) ? "<transducer>" : "<sequence>"); break;
+    case LVAL_STR: lval_print_str_to(v, f); break;
+    case LVAL_DATA: {
+      lval* x = lval_data_expand(lval_copy(v));
+      lval_print_to(x, f);
+      lval_free(x);
+    }
+    break;
   }
 }
 
+void lval_println_to(lval* v, FILE* f) {
+  lval_print_to(v, f); fputc('\n', f);
+}
+
+void lval_print(lval* v) {
+  lval_print_to(v, stdout);
+}
+
 void lval_println(lval* v) {
-  lval_print(v); putchar('\n');
+  lval_println_to(v, stdout);
 }
 
 /* Builtins */
 
 lval* builtin_var(lenv* e, lval* a, char* func) {
+  lval_force(a);
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
-  lval* syms = a->cell[0];
+  lval* syms = LPTR(a->cell[0]);
 
   UPTO(syms->count) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM), "Function '%s' cannot define non-symbol! Got %s, expected %s.", func, ltype2name(syms->cell[i]->type), ltype2name(LVAL_SYM));
+    LASSERT(a, (LPTR(syms->cell[i])->type == LVAL_SYM), "Function '%s' cannot define non-symbol! Got %s, expected %s.", func, ltype2name(LPTR(syms->cell[i])->type), ltype2name(LVAL_SYM));
   }
 
   LASSERT(a, syms->count == a->count-1, "Function '%s' needs a value for each symbol!", func);
 
   UPTO(syms->count) {
     if (strcmp(func, "def")==0) {
-      lenv_global_put(e, syms->cell[i], a->cell[i+1]);
+      lenv_global_put(e, LPTR(syms->cell[i]), LPTR(a->cell[i+1]));
     }
     if (strcmp(func, "=")==0) {
-      lenv_put(e, syms->cell[i], a->cell[i+1]);
+      lenv_put(e, LPTR(syms->cell[i]), LPTR(a->cell[i+1]));
     }
   }
 
@@ -496,12 +1327,13 @@ lval* builtin_set(lenv* e, lval* a) {
 }
 
 lval* builtin_lambda(lenv* e, lval* a) {
+  lval_force(a);
   LASSERT_NUM("fun", a, 2);
   LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
   LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
 
-  UPTO(a->cell[0]->count) {
-    LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s, expected %s.", ltype2name(a->cell[0]->cell[i]->type), ltype2name(LVAL_SYM));
+  UPTO(LPTR(a->cell[0])->count) {
+    LASSERT(a, (LPTR(LPTR(a->cell[0])->cell[i])->type == LVAL_SYM), "Cannot define non-symbol. Got %s, expected %s.", ltype2name(LPTR(LPTR(a->cell[0])->cell[i])->type), ltype2name(LVAL_SYM));
   }
 
   lval* formals = lval_pop(a, 0);
@@ -512,21 +1344,23 @@ lval* builtin_lambda(lenv* e, lval* a) {
 }
 
 lval* builtin_head(lenv* e, lval* a) {
+  lval_force(a);
   LASSERT(a, a->count==1, "Function 'head' wrong numberof arguments! Got %i, expected 1.", a->count);
-  LASSERT(a, a->cell[0]->type==LVAL_QEXPR, "Function 'head' passed incorrect type! Got %s, expected %s.", ltype2name(a->cell[0]->type), ltype2name(LVAL_QEXPR));
-  LASSERT(a, a->cell[0]->count!=0, "Function 'head' passed {}!");
+  LASSERT(a, LPTR(a->cell[0])->type==LVAL_QEXPR, "Function 'head' passed incorrect type! Got %s, expected %s.", ltype2name(LPTR(a->cell[0])->type), ltype2name(LVAL_QEXPR));
+  LASSERT(a, LPTR(a->cell[0])->count!=0, "Function 'head' passed {}!");
 
+  /* Copy the first value rather than popping the rest off a shared list */
   lval* v = lval_take(a, 0);
-  while (v->count > 1) {
-    lval_free(lval_pop(v,1));
-  }
-  return v;
+  lval* x = lval_add(lval_qexpr(), lval_copy(LPTR(v->cell[0])));
+  lval_free(v);
+  return x;
 }
 
 lval* builtin_tail(lenv* e, lval* a) {
+  lval_force(a);
   LASSERT(a, a->count==1, "Function 'tail' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'tail' passed incorrect types!");
-  LASSERT(a, a->cell[0]->count!=0, "Function 'tail' passed {}!");
+  LASSERT(a, LPTR(a->cell[0])->type == LVAL_QEXPR, "Function 'tail' passed incorrect types!");
+  LASSERT(a, LPTR(a->cell[0])->count!=0, "Function 'tail' passed {}!");
 
   lval* v = lval_take(a,0);
   lval_free(lval_pop(v,0));
@@ -539,8 +1373,9 @@ lval* builtin_list(lenv* e, lval* a) {
 }
 
 lval* builtin_eval(lenv* e, lval* a) {
+  lval_force(a);
   LASSERT(a, a->count==1, "Function 'eval' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type==LVAL_QEXPR, "Function 'eval' passed incorrect types!");
+  LASSERT(a, LPTR(a->cell[0])->type==LVAL_QEXPR, "Function 'eval' passed incorrect types!");
 
   lval* x = lval_take(a,0);
   x->type = LVAL_SEXPR;
@@ -548,8 +1383,9 @@ lval* builtin_eval(lenv* e, lval* a) {
 }
 
 lval* builtin_join(lenv* e, lval* a) {
+  lval_force(a);
   UPTO(a->count) {
-    LASSERT(a, a->cell[i]->type==LVAL_QEXPR, "Function 'join' passed incorrect types!");
+    LASSERT(a, LPTR(a->cell[i])->type==LVAL_QEXPR, "Function 'join' passed incorrect types!");
   }
 
   lval* x = lval_pop(a,0);
@@ -560,9 +1396,48 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
+lval* builtin_throw(lenv* e, lval* a) {
+  LASSERT_NUM("throw", a, 1);
+  return lval_throw(lval_take(a, 0));
+}
+
+/* Evaluates the body, and on an error calls the handler with the */
+/* thrown value, or with the message of an error raised by a builtin */
+lval* builtin_try(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("try", a, 2);
+  LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("try", a, 1, LVAL_FUN);
+
+  lval* body = lval_pop(a, 0);
+  body->type = LVAL_SEXPR;
+  lval* x = lval_eval(e, body);
+
+  /* Running out of budget is not for scripts to catch */
+  if (x->type != LVAL_ERR || budget.tripped) {
+    lval_free(a);
+    return x;
+  }
+
+  /* Only now is an error's message formatted */
+  lval* caught = x->thrown;
+  if (!caught) {
+    caught = lval_new(LVAL_STR);
+    caught->str = lerr_format(x);
+    lbudget_alloc(strlen(caught->str)+1);
+  }
+  x->thrown = NULL;
+  lval_free(x);
+
+  lval* f = lval_take(a, 0);
+  lval* r = lval_call(e, f, lval_add(lval_sexpr(), caught));
+  lval_free(f);
+  return r;
+}
+
 lval* builtin_op(lenv* e, lval* a, char* op) {
   UPTO(a->count) {
-    if (a->cell[i]->type!=LVAL_NUM) {
+    if (LPTR(a->cell[i])->type!=LVAL_NUM) {
       lval_free(a);
       return lval_err("Cannot operate on non-number");
     }
@@ -613,13 +1488,12 @@ lval* builtin_div(lenv* e, lval* a) {
 /* Eval */
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  /* Stop at the first error, the cells after it are never evaluated */
+  lval_own(v);
   UPTO(v->count) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
-
-  UPTO(v->count) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v,i);
+    v->cell[i] = LREF(lval_eval(e, LPTR(v->cell[i])));
+    if (LPTR(v->cell[i])->type == LVAL_ERR) {
+      return lval_take(v, i);
     }
   }
 
@@ -639,83 +1513,2003 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   return result;
 }
 
+lval* lbudget_step(void) {
+  if (!budget.tripped) {
+    budget.steps++;
+    if (limits.steps && budget.steps > limits.steps) {
+      budget.tripped = LBUDGET_STEPS;
+    }
+    lbudget_tick();
+  }
+  switch (budget.tripped) {
+    case LBUDGET_STEPS: return lval_err("Evaluation exceeded the limit of %li steps.", limits.steps);
+    case LBUDGET_BYTES: return lval_err("Evaluation exceeded the limit of %li bytes.", limits.bytes);
+    case LBUDGET_TIME: return lval_err("Evaluation exceeded the limit of %li ms.", limits.millis);
+    case LBUDGET_CANCEL: return lval_err("Task cancelled while blocked.");
+    default: return NULL;
+  }
+}
+
 lval* lval_eval(lenv* e, lval* v) {
+  lval* err = lbudget_step();
+  if (err) { lval_free(v); return err; }
   if (v->type==LVAL_SYM) {
     lval* x = lenv_get(e, v);
     lval_free(v);
     return x;
   }
+  if (v->type==LVAL_DATA && lval_data_sexpr(v)) {
+    v = lval_data_expand(v);
+  }
   if (v->type==LVAL_SEXPR) {
+    if (ltask_stack_low()) {
+      lval_free(v);
+      return lval_err("Evaluation nested too deeply for the task stack.");
+    }
     return lval_eval_sexpr(e, v);
   }
   return v;
 }
 
-/* Add all builtins to env */
+/* Tasks */
+
+/* Green threads run on their own C stacks (ucontext) so a task can */
+/* be suspended anywhere inside lval_eval. Each thread has its own */
+/* scheduler: tasks are switched to from the thread's main context */
+/* and switch back to it when they yield, block or finish. Tasks run */
+/* while the top level evaluation waits on them and when it is done. */
+/* Tasks blocked on a file descriptor are polled for whenever the */
+/* scheduler runs. Channels can be shared between threads, so a task */
+/* blocked on one is woken through its own thread's woken list, and */
+/* a pipe interrupts that thread's poll. A task nothing can wake any */
+/* more is resumed with a tripped budget, which unwinds it. */
+
+/* Task stacks are mapped with a guard page below them. Evaluation */
+/* stops with an error while LTASK_RESERVE bytes are still left, so */
+/* the builtins and the unwinding have room to run. */
+enum { LTASK_STACK = 1024 * 1024, LTASK_RESERVE = 64 * 1024 };
+
+typedef struct {
+  ucontext_t main;
+  ltask* current;
+  ltask* head;
+  ltask* tail;
+  long ids;
+  int io_num;
+  int io_slots;
+  struct pollfd* io_fds;
+  ltask** io_tasks;
+  int blocked_num;
+  int blocked_slots;
+  ltask** blocked;
+  int open;
+  int wake[2];
+  pthread_mutex_t lock;
+  ltask* woken;
+  ltask* woken_tail;
+} lsched;
+
+struct ltask {
+  ucontext_t ctx;
+  char* stack;
+  lsched* owner;
+  lenv* env;
+  lval* f;
+  lval* args;
+  int done;
+  int cancelled;
+  lchan* waiting;
+  ltask* next;
+};
 
-void lenv_add_builtins(lenv* e) {
-  lenv_add_builtin(e, "def", builtin_def); /* Global var */
-  lenv_add_builtin(e, "=", builtin_set); /* Local var */
-  lenv_add_builtin(e, "fun", builtin_lambda);
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
+__thread lsched sched;
+
+void lsched_push(ltask* t) {
+  t->next = NULL;
+  if (sched.tail) { sched.tail->next = t; } else { sched.head = t; }
+  sched.tail = t;
 }
 
-/* Main */
+/* Runs the next runnable task until it yields, blocks or finishes */
+void lsched_run_one(void) {
+  ltask* t = sched.head;
+  sched.head = t->next;
+  if (!sched.head) { sched.tail = NULL; }
+
+  int tripped = budget.tripped;
+  if (t->cancelled) { budget.tripped = LBUDGET_CANCEL; }
+
+  sched.current = t;
+  swapcontext(&sched.main, &t->ctx);
+  sched.current = NULL;
+
+  if (t->cancelled) { budget.tripped = tripped; }
+
+  if (t->done) {
+    munmap(t->stack, LTASK_STACK + sysconf(_SC_PAGESIZE));
+    free(t);
+  }
+}
+
+/* Whether the running task is within LTASK_RESERVE of its guard page */
+int ltask_stack_low(void) {
+  char here;
+  ltask* t = sched.current;
+  return t && &here - (t->stack + sysconf(_SC_PAGESIZE)) < LTASK_RESERVE;
+}
+
+/* Gives the other tasks a turn */
+void lsched_yield(void) {
+  if (sched.current) {
+    lsched_push(sched.current);
+    swapcontext(&sched.current->ctx, &sched.main);
+  } else if (sched.head) {
+    lsched_run_one();
+  }
+}
+
+void ltask_entry(void) {
+  ltask* t = sched.current;
+  lval_free(lval_call(t->env, t->f, t->args));
+  lval_free(t->f);
+  t->done = 1;
+  swapcontext(&t->ctx, &sched.main);
+}
+
+/* Lets other threads wake this thread's tasks blocked on channels */
+void lsched_open(void) {
+  if (sched.open) { return; }
+  pthread_mutex_init(&sched.lock, NULL);
+  if (pipe(sched.wake) == -1) {
+    sched.wake[0] = sched.wake[1] = -1;
+  } else {
+    fcntl(sched.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(sched.wake[1], F_SETFL, O_NONBLOCK);
+  }
+  sched.open = 1;
+}
+
+/* Makes a task blocked on a channel runnable on the thread owning it. */
+/* Called with the channel locked, so its owner sees it in either the */
+/* channel's waiters or its woken list. */
+void lsched_wake(ltask* t) {
+  lsched* s = t->owner;
+  if (s == &sched) { lsched_push(t); return; }
+  pthread_mutex_lock(&s->lock);
+  t->next = NULL;
+  if (s->woken_tail) { s->woken_tail->next = t; } else { s->woken = t; }
+  s->woken_tail = t;
+  pthread_mutex_unlock(&s->lock);
+  while (write(s->wake[1], "", 1) == -1 && errno == EINTR);
+}
+
+/* Moves the tasks woken by other threads to the run queue */
+void lsched_take(void) {
+  if (!sched.open) { return; }
+  pthread_mutex_lock(&sched.lock);
+  ltask* t = sched.woken;
+  sched.woken = sched.woken_tail = NULL;
+  pthread_mutex_unlock(&sched.lock);
+  while (t) {
+    ltask* next = t->next;
+    lsched_push(t);
+    t = next;
+  }
+}
+
+/* Keeps room for one more waiting task, the caller's fd and the pipe */
+void lsched_reserve(void) {
+  if (sched.io_num + 3 <= sched.io_slots) { return; }
+  sched.io_slots = (sched.io_num + 3) * 2;
+  sched.io_fds = realloc(sched.io_fds, sizeof(struct pollfd) * sched.io_slots);
+  sched.io_tasks = realloc(sched.io_tasks, sizeof(ltask*) * sched.io_slots);
+}
+
+/* Makes the i-th task waiting on io runnable again */
+void lsched_unpoll(int i) {
+  lsched_push(sched.io_tasks[i]);
+  sched.io_num--;
+  sched.io_fds[i] = sched.io_fds[sched.io_num];
+  sched.io_tasks[i] = sched.io_tasks[sched.io_num];
+}
+
+/* Polls the tasks waiting on io, plus fd if it is not -1, making */
+/* the ready ones runnable. Returns whether fd itself is ready. */
+int lsched_poll(int timeout, int fd, short events) {
+  int n = sched.io_num;
+  int m = n + (fd != -1);
+  lsched_reserve();
+  sched.io_fds[n].fd = fd;
+  sched.io_fds[n].events = events;
+  sched.io_fds[n].revents = 0;
+  if (sched.open) {
+    sched.io_fds[m].fd = sched.wake[0];
+    sched.io_fds[m].events = POLLIN;
+    sched.io_fds[m].revents = 0;
+  }
+
+  int left = lbudget_millis_left();
+  if (left >= 0 && (timeout < 0 || left < timeout)) { timeout = left; }
+  if (poll(sched.io_fds, m + sched.open, timeout) == -1) { sched.io_fds[n].revents = 0; }
+  if (left == 0 && !budget.tripped) { budget.tripped = LBUDGET_TIME; }
+
+  int ready = fd != -1 && sched.io_fds[n].revents;
+  if (sched.open && sched.io_fds[m].revents) {
+    char drain[64];
+    while (read(sched.wake[0], drain, sizeof(drain)) > 0);
+  }
+  for (int i = n-1; i >= 0; i--) {
+    if (sched.io_fds[i].revents) { lsched_unpoll(i); }
+  }
+  lsched_take();
+  return ready;
+}
+
+/* Blocks until fd is ready. A task is parked meanwhile, the top */
+/* level runs the other tasks. Callers must check the budget after. */
+void lsched_wait(int fd, short events) {
+  ltask* t = sched.current;
+  if (t) {
+    lsched_reserve();
+    sched.io_fds[sched.io_num].fd = fd;
+    sched.io_fds[sched.io_num].events = events;
+    sched.io_tasks[sched.io_num++] = t;
+    swapcontext(&t->ctx, &sched.main);
+    return;
+  }
+  while (!budget.tripped) {
+    if (lsched_poll(sched.head ? 0 : -1, fd, events)) { return; }
+    if (sched.head) { lsched_run_one(); }
+  }
+}
+
+/* Cancels the tasks still on a channel's waiters. The ones missing */
+/* from it were woken and are already on this thread's woken list. */
+void lsched_cancel_blocked(void) {
+  UPTO(sched.blocked_num) {
+    ltask* t = sched.blocked[i];
+    lchan* c = t->waiting;
+    pthread_mutex_lock(&c->lock);
+    if (lchan_unwait(c, t)) {
+      t->cancelled = 1;
+      lsched_push(t);
+    }
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+/* Runs tasks until all are finished or blocked. With wait set it */
+/* also waits up to that many ms (-1 for no limit) for the ones */
+/* blocked on io, and once out of time or budget cancels them. Tasks */
+/* blocked on channels are cancelled once no io is left to wake them, */
+/* so none is left behind. */
+void lsched_drain(int wait) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += wait / 1000;
+  end.tv_nsec += (wait % 1000) * 1000000L;
+  if (end.tv_nsec >= 1000000000) {
+    end.tv_sec++;
+    end.tv_nsec -= 1000000000;
+  }
+
+  while (1) {
+    lsched_take();
+    if (sched.io_num) { lsched_poll(0, -1, 0); }
+    if (sched.head) { lsched_run_one(); continue; }
+    if (!wait || !(sched.io_num || sched.blocked_num)) { break; }
+
+    long left = -1;
+    if (wait > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+      if (left < 0) { left = 0; }
+    }
+
+    if (budget.tripped || left == 0 || !sched.io_num) {
+      while (sched.io_num) {
+        sched.io_tasks[0]->cancelled = 1;
+        lsched_unpoll(0);
+      }
+      lsched_cancel_blocked();
+    } else {
+      lsched_poll(left, -1, 0);
+    }
+  }
+}
+
+lval* lval_chan(void) {
+  lval* v = lval_new(LVAL_CHAN);
+  v->chan = calloc(1, sizeof(lchan));
+  v->chan->refs = 1;
+  pthread_mutex_init(&v->chan->lock, NULL);
+  return v;
+}
+
+/* A blocked task holds its channel, so none are left waiting here */
+void lchan_free(lchan* c) {
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+  UPTO(c->count) {
+    lval_free(c->vals[(c->first + i) % c->slots]);
+  }
+  pthread_mutex_destroy(&c->lock);
+  free(c->vals);
+  free(c->waiters);
+  free(c);
+}
+
+/* Removes t from the waiters, returns whether it was still there */
+int lchan_unwait(lchan* c, ltask* t) {
+  UPTO(c->waiters_num) {
+    if (c->waiters[i] == t) {
+      c->waiters[i] = c->waiters[--c->waiters_num];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "Function 'spawn' passed no arguments.");
+  LASSERT_TYPE("spawn", a, 0, LVAL_FUN);
+
+  /* Tasks may outlive the caller, so they run in the top environment */
+  while (e->parent && !e->parent->shared) { e = e->parent; }
+
+  long page = sysconf(_SC_PAGESIZE);
+  char* stack = mmap(NULL, LTASK_STACK + page, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (stack == MAP_FAILED) {
+    lval_free(a);
+    return lval_err("Function 'spawn' could not allocate a task stack.");
+  }
+  mprotect(stack, page, PROT_NONE);
+
+  ltask* t = calloc(1, sizeof(ltask));
+  t->stack = stack;
+  t->owner = &sched;
+  t->env = e;
+  t->f = lval_pop(a, 0);
+  t->args = a;
+  getcontext(&t->ctx);
+  t->ctx.uc_stack.ss_sp = stack + page;
+  t->ctx.uc_stack.ss_size = LTASK_STACK;
+  t->ctx.uc_link = NULL;
+  makecontext(&t->ctx, ltask_entry, 0);
+
+  lsched_push(t);
+  return lval_num(++sched.ids);
+}
+
+lval* builtin_yield(lenv* e, lval* a) {
+  LASSERT_NUM("yield", a, 1);
+  lsched_yield();
+  lval* err = lbudget_step();
+  if (err) { lval_free(a); return err; }
+  return lval_take(a, 0);
+}
+
+lval* builtin_chan(lenv* e, lval* a) {
+  lval_free(a);
+  return lval_chan();
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+  LASSERT_NUM("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+  lchan* c = LPTR(a->cell[0])->chan;
+  lval* x = lval_pop(a, 1);
+  pthread_mutex_lock(&c->lock);
+  if (c->count == c->slots) {
+    int slots = c->slots ? c->slots * 2 : 8;
+    lval** vals = malloc(sizeof(lval*) * slots);
+    UPTO(c->count) { vals[i] = c->vals[(c->first + i) % c->slots]; }
+    free(c->vals);
+    c->vals = vals;
+    c->slots = slots;
+    c->first = 0;
+  }
+  c->vals[(c->first + c->count++) % c->slots] = x;
+
+  if (c->waiters_num) {
+    ltask* t = c->waiters[0];
+    lchan_unwait(c, t);
+    lsched_wake(t);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  lval_free(a);
+  return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+  LASSERT_NUM("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+  lchan* c = LPTR(a->cell[0])->chan;
+  pthread_mutex_lock(&c->lock);
+  while (c->count == 0) {
+    ltask* t = sched.current;
+    if (t) {
+      lsched_open();
+      c->waiters = realloc(c->waiters, sizeof(ltask*) * (c->waiters_num + 1));
+      c->waiters[c->waiters_num++] = t;
+      t->waiting = c;
+      if (sched.blocked_num == sched.blocked_slots) {
+        sched.blocked_slots = sched.blocked_slots ? sched.blocked_slots * 2 : 8;
+        sched.blocked = realloc(sched.blocked, sizeof(ltask*) * sched.blocked_slots);
+      }
+      sched.blocked[sched.blocked_num++] = t;
+      pthread_mutex_unlock(&c->lock);
+      swapcontext(&t->ctx, &sched.main);
+      pthread_mutex_lock(&c->lock);
+      lchan_unwait(c, t);
+      UPTO(sched.blocked_num) {
+        if (sched.blocked[i] == t) {
+          sched.blocked[i] = sched.blocked[--sched.blocked_num];
+          break;
+        }
+      }
+      t->waiting = NULL;
+    } else {
+      pthread_mutex_unlock(&c->lock);
+      lsched_take();
+      if (sched.head) {
+        lsched_run_one();
+      } else if (sched.io_num) {
+        lsched_poll(-1, -1, 0);
+      } else {
+        lval_free(a);
+        return lval_err("Deadlock. Function 'recv' waits on an empty channel with no task left to run.");
+      }
+      pthread_mutex_lock(&c->lock);
+    }
+    lval* err = lbudget_step();
+    if (err) {
+      pthread_mutex_unlock(&c->lock);
+      lval_free(a);
+      return err;
+    }
+  }
+
+  lval* x = c->vals[c->first];
+  c->first = (c->first + 1) % c->slots;
+  c->count--;
+  pthread_mutex_unlock(&c->lock);
+  lval_free(a);
+  return x;
+}
+
+/* Io */
+
+/* Files and sockets never block the thread. Sockets are non blocking */
+/* and wait for readiness through the scheduler. Regular files are */
+/* always ready, so long transfers yield between chunks instead, which */
+/* lets other tasks run. Sockets are values that own their descriptor, */
+/* so scripts can only use the ones they opened. A socket is closed by */
+/* close or once the last value holding it is freed. */
+
+enum { LIO_CHUNK = 64 * 1024 };
+
+lval* lval_sock(int fd) {
+  lval* v = lval_new(LVAL_SOCK);
+  v->sock = malloc(sizeof(lsock));
+  v->sock->refs = 1;
+  v->sock->fd = fd;
+  return v;
+}
+
+void lsock_free(lsock* s) {
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+  if (s->fd != -1) { close(s->fd); }
+  free(s);
+}
+
+#define LASSERT_SOCK(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_SOCK); \
+  LASSERT(args, __atomic_load_n(&LPTR(args->cell[index])->sock->fd, __ATOMIC_ACQUIRE) != -1, \
+    "Function '%s' passed a closed socket.", func);
+
+int lsock_fd(lval* a, int index) {
+  return __atomic_load_n(&LPTR(a->cell[index])->sock->fd, __ATOMIC_ACQUIRE);
+}
+
+lval* lio_fail(lval* a, char* func, char* what) {
+  lval* err = lval_err("Function '%s' could not %s: %s.", func, what, strerror(errno));
+  lval_free(a);
+  return err;
+}
+
+/* Reads fd to the end, or only what is there when all is 0 */
+lval* lio_read(int fd, int all, char* func) {
+  size_t len = 0;
+  size_t cap = LIO_CHUNK;
+  char* buf = malloc(cap + 1);
+  while (1) {
+    if (len + LIO_CHUNK > cap) {
+      cap *= 2;
+      buf = realloc(buf, cap + 1);
+    }
+    ssize_t n = read(fd, buf + len, LIO_CHUNK);
+    if (n == -1 && errno == EINTR) { continue; }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      lsched_wait(fd, POLLIN);
+    } else if (n == -1) {
+      lval* err = lval_err("Function '%s' could not read: %s.", func, strerror(errno));
+      free(buf);
+      return err;
+    } else {
+      len += n;
+      if (n == 0 || !all) { break; }
+      lsched_yield();
+    }
+    lval* err = lbudget_step();
+    if (err) { free(buf); return err; }
+  }
+  buf[len] = '\0';
+  lval* x = lval_str(buf);
+  free(buf);
+  return x;
+}
+
+lval* lio_write(int fd, int sock, char* s, size_t len, char* func) {
+  size_t pos = 0;
+  while (pos < len) {
+    size_t chunk = len - pos < LIO_CHUNK ? len - pos : LIO_CHUNK;
+    ssize_t n = sock ?
+      send(fd, s + pos, chunk, MSG_NOSIGNAL) : write(fd, s + pos, chunk);
+    if (n == -1 && errno == EINTR) { continue; }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      lsched_wait(fd, POLLOUT);
+    } else if (n == -1) {
+      return lval_err("Function '%s' could not write: %s.", func, strerror(errno));
+    } else {
+      pos += n;
+      if (pos < len) { lsched_yield(); }
+    }
+    lval* err = lbudget_step();
+    if (err) { return err; }
+  }
+  return lval_sexpr();
+}
+
+lval* lio_read_file(lval* a, char* func) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_STR);
+  int fd = open(LPTR(a->cell[0])->str, O_RDONLY | O_NONBLOCK);
+  if (fd == -1) { return lio_fail(a, func, "open the file"); }
+  lval* x = lio_read(fd, 1, func);
+  close(fd);
+  lval_free(a);
+  return x;
+}
+
+lval* builtin_read_file(lenv* e, lval* a) {
+  return lio_read_file(a, "read-file");
+}
+
+lval* builtin_read_lines(lenv* e, lval* a) {
+  lval* x = lio_read_file(a, "read-lines");
+  if (x->type == LVAL_ERR) { return x; }
+
+  lval* lines = lval_qexpr();
+  char* line = x->str;
+  while (*line) {
+    size_t len = strcspn(line, "\n");
+    int last = line[len] == '\0';
+    line[len] = '\0';
+    lval_add(lines, lval_str(line));
+    line += len + !last;
+  }
+  lval_free(x);
+  return lines;
+}
+
+lval* builtin_write_file(lenv* e, lval* a) {
+  LASSERT_NUM("write-file", a, 2);
+  LASSERT_TYPE("write-file", a, 0, LVAL_STR);
+  LASSERT_TYPE("write-file", a, 1, LVAL_STR);
+  int fd = open(LPTR(a->cell[0])->str, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666);
+  if (fd == -1) { return lio_fail(a, "write-file", "open the file"); }
+  lval* x = lio_write(fd, 0, LPTR(a->cell[1])->str, strlen(LPTR(a->cell[1])->str), "write-file");
+  close(fd);
+  lval_free(a);
+  return x;
+}
+
+/* Addresses are host:port for TCP, anything else is a Unix socket path */
+int lio_socket(char* addr, int listening) {
+  struct sockaddr_un un;
+  struct addrinfo hints;
+  struct addrinfo* res = NULL;
+  struct sockaddr* sa;
+  socklen_t sa_len;
+  char* colon = strrchr(addr, ':');
+
+  if (colon && !strchr(addr, '/')) {
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0) {
+      errno = EADDRNOTAVAIL;
+      return -1;
+    }
+    sa = res->ai_addr;
+    sa_len = res->ai_addrlen;
+  } else {
+    if (strlen(addr) >= sizeof(un.sun_path)) { errno = ENAMETOOLONG; return -1; }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, addr);
+    sa = (struct sockaddr*)&un;
+    sa_len = sizeof(un);
+    if (listening) { unlink(addr); }
+  }
+
+  int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+  int ok = fd != -1;
+  if (ok) {
+    int one = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (listening) {
+      if (sa->sa_family != AF_UNIX) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      }
+      ok = bind(fd, sa, sa_len) == 0 && listen(fd, SOMAXCONN) == 0;
+    } else {
+      /* Finished once writable, see builtin_connect */
+      ok = connect(fd, sa, sa_len) == 0 || errno == EINPROGRESS;
+    }
+  }
+
+  int saved = errno;
+  if (res) { freeaddrinfo(res); }
+  if (!ok && fd != -1) { close(fd); fd = -1; }
+  errno = saved;
+  return fd;
+}
+
+lval* builtin_listen(lenv* e, lval* a) {
+  LASSERT_NUM("listen", a, 1);
+  LASSERT_TYPE("listen", a, 0, LVAL_STR);
+  int fd = lio_socket(LPTR(a->cell[0])->str, 1);
+  if (fd == -1) { return lio_fail(a, "listen", "listen"); }
+  lval_free(a);
+  return lval_sock(fd);
+}
+
+lval* builtin_connect(lenv* e, lval* a) {
+  LASSERT_NUM("connect", a, 1);
+  LASSERT_TYPE("connect", a, 0, LVAL_STR);
+  int fd = lio_socket(LPTR(a->cell[0])->str, 0);
+  if (fd == -1) { return lio_fail(a, "connect", "connect"); }
+
+  lsched_wait(fd, POLLOUT);
+  lval* err = lbudget_step();
+  if (err) { close(fd); lval_free(a); return err; }
+
+  int status = 0;
+  socklen_t len = sizeof(status);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &status, &len);
+  if (status) {
+    close(fd);
+    errno = status;
+    return lio_fail(a, "connect", "connect");
+  }
+  lval_free(a);
+  return lval_sock(fd);
+}
+
+lval* builtin_accept(lenv* e, lval* a) {
+  LASSERT_NUM("accept", a, 1);
+  LASSERT_SOCK("accept", a, 0);
+  int fd = lsock_fd(a, 0);
+  while (1) {
+    int c = accept(fd, NULL, NULL);
+    if (c != -1) {
+      fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+      lval_free(a);
+      return lval_sock(c);
+    }
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      return lio_fail(a, "accept", "accept");
+    }
+    lsched_wait(fd, POLLIN);
+    lval* err = lbudget_step();
+    if (err) { lval_free(a); return err; }
+  }
+}
+
+lval* builtin_read_socket(lenv* e, lval* a) {
+  LASSERT_NUM("read-socket", a, 1);
+  LASSERT_SOCK("read-socket", a, 0);
+  lval* x = lio_read(lsock_fd(a, 0), 0, "read-socket");
+  lval_free(a);
+  return x;
+}
+
+lval* builtin_write_socket(lenv* e, lval* a) {
+  LASSERT_NUM("write-socket", a, 2);
+  LASSERT_SOCK("write-socket", a, 0);
+  LASSERT_TYPE("write-socket", a, 1, LVAL_STR);
+  lval* x = lio_write(lsock_fd(a, 0), 1, LPTR(a->cell[1])->str,
+    strlen(LPTR(a->cell[1])->str), "write-socket");
+  lval_free(a);
+  return x;
+}
+
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_SOCK("close", a, 0);
+  /* Other values holding the socket see it closed */
+  int fd = __atomic_exchange_n(&LPTR(a->cell[0])->sock->fd, -1, __ATOMIC_ACQ_REL);
+  if (fd != -1 && close(fd) == -1) { return lio_fail(a, "close", "close"); }
+  lval_free(a);
+  return lval_sexpr();
+}
+
+/* Data */
+
+/* dump-data writes a value to a file as a binary image and mmap-data */
+/* maps one back read only, so loading is constant time and the pages */
+/* are shared by every process mapping the file. The image is a tree */
+/* of 8 byte aligned nodes that refer to their children by offset. A */
+/* mapped list stays a reference into the image until a builtin looks */
+/* inside it, and is then decoded one level only: atoms are copied out */
+/* and nested lists become references in turn. */
+
+#define LDATA_MAGIC "LSPYDAT1"
+
+enum { LDATA_NUM, LDATA_SYM, LDATA_STR, LDATA_SEXPR, LDATA_QEXPR };
+
+typedef struct {
+  uint32_t type;
+  uint32_t count;
+} ldata_node;
+
+typedef struct {
+  char* buf;
+  size_t len;
+  size_t cap;
+} ldump;
+
+void ldata_free(ldata* m) {
+  if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+  munmap(m->base, m->size);
+  free(m);
+}
+
+lval* lval_data(ldata* m, size_t off) {
+  lval* v = lval_new(LVAL_DATA);
+  __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+  v->data = m;
+  v->off = off;
+  return v;
+}
+
+/* The node at off if it and size bytes after it are in the image */
+ldata_node* ldata_at(ldata* m, size_t off, size_t size) {
+  if (off % 8 || off < 16 || off > m->size
+  ||  m->size - off < sizeof(ldata_node) + size) { return NULL; }
+  return (ldata_node*)(m->base + off);
+}
+
+lval* ldata_decode(ldata* m, size_t off) {
+  ldata_node* n = ldata_at(m, off, 0);
+  if (!n) { return lval_err("Data image is corrupt."); }
+  char* payload = (char*)(n + 1);
+  int64_t num;
+  switch (n->type) {
+    case LDATA_NUM:
+      if (!ldata_at(m, off, sizeof(int64_t))) { break; }
+      memcpy(&num, payload, sizeof(int64_t));
+      return lval_num(num);
+    case LDATA_SYM:
+    case LDATA_STR:
+      if (!ldata_at(m, off, (size_t)n->count + 1) || payload[n->count]) { break; }
+      return n->type == LDATA_SYM ? lval_sym(payload) : lval_str(payload);
+    case LDATA_SEXPR:
+    case LDATA_QEXPR:
+      if (!ldata_at(m, off, sizeof(uint64_t) * n->count)) { break; }
+      return lval_data(m, off);
+  }
+  return lval_err("Data image is corrupt.");
+}
+
+/* Turns a mapped list into a list of its decoded elements */
+lval* lval_data_expand(lval* v) {
+  ldata_node* n = (ldata_node*)(v->data->base + v->off);
+  uint64_t* offs = (uint64_t*)(n + 1);
+  lval* x = n->type == LDATA_SEXPR ? lval_sexpr() : lval_qexpr();
+  lval_resize(x, n->count);
+  x->count = n->count;
+  lbudget_alloc(sizeof(lref) * x->count);
+  UPTO(x->count) {
+    x->cell[i] = LREF(ldata_decode(v->data, offs[i]));
+  }
+  lval_free(v);
+  return x;
+}
+
+int lval_data_sexpr(lval* v) {
+  return ((ldata_node*)(v->data->base + v->off))->type == LDATA_SEXPR;
+}
+
+/* Decodes the mapped arguments of a builtin that looks inside lists */
+void lval_force(lval* a) {
+  lval_own(a);
+  UPTO(a->count) {
+    if (LPTR(a->cell[i])->type == LVAL_DATA) {
+      a->cell[i] = LREF(lval_data_expand(LPTR(a->cell[i])));
+    }
+  }
+}
+
+size_t ldump_reserve(ldump* d, size_t n) {
+  size_t off = d->len;
+  n = (n + 7) & ~(size_t)7;
+  while (d->len + n > d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 4096;
+    d->buf = realloc(d->buf, d->cap);
+  }
+  memset(d->buf + off, 0, n);
+  d->len += n;
+  return off;
+}
+
+size_t ldump_node(ldump* d, int type, size_t count, size_t size) {
+  ldata_node n = { type, count };
+  size_t off = ldump_reserve(d, sizeof(ldata_node) + size);
+  memcpy(d->buf + off, &n, sizeof(ldata_node));
+  return off;
+}
+
+/* Appends v and returns its offset, or 0 if it has no image */
+size_t ldump_put(ldump* d, lval* v) {
+  size_t off = 0;
+  int64_t num;
+  switch (v->type) {
+    case LVAL_NUM:
+      num = v->num;
+      off = ldump_node(d, LDATA_NUM, 0, sizeof(int64_t));
+      memcpy(d->buf + off + sizeof(ldata_node), &num, sizeof(int64_t));
+    break;
+    case LVAL_SYM:
+    case LVAL_STR: {
+      char* s = v->type == LVAL_SYM ? lname_str(&v->sym) : v->str;
+      off = ldump_node(d, v->type == LVAL_SYM ? LDATA_SYM : LDATA_STR, strlen(s), strlen(s) + 1);
+      strcpy(d->buf + off + sizeof(ldata_node), s);
+    }
+    break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      off = ldump_node(d, v->type == LVAL_SEXPR ? LDATA_SEXPR : LDATA_QEXPR,
+        v->count, sizeof(uint64_t) * v->count);
+      UPTO(v->count) {
+        /* Children go after, the buffer may move while they are added */
+        uint64_t child = ldump_put(d, LPTR(v->cell[i]));
+        if (!child) { return 0; }
+        memcpy(d->buf + off + sizeof(ldata_node) + sizeof(uint64_t) * i, &child, sizeof(uint64_t));
+      }
+    break;
+    case LVAL_DATA: {
+      lval* x = lval_data_expand(lval_copy(v));
+      off = ldump_put(d, x);
+      lval_free(x);
+    }
+    break;
+  }
+  return off;
+}
+
+lval* builtin_dump_data(lenv* e, lval* a) {
+  LASSERT_NUM("dump-data", a, 2);
+  LASSERT_TYPE("dump-data", a, 0, LVAL_STR);
+
+  ldump d = { NULL, 0, 0 };
+  ldump_reserve(&d, 16);
+  memcpy(d.buf, LDATA_MAGIC, 8);
+  uint64_t root = ldump_put(&d, LPTR(a->cell[1]));
+  if (!root) {
+    free(d.buf);
+    lval* err = lval_err("Function 'dump-data' can only dump numbers, symbols, strings and lists.");
+    lval_free(a);
+    return err;
+  }
+  memcpy(d.buf + 8, &root, sizeof(uint64_t));
+
+  int fd = open(LPTR(a->cell[0])->str, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0666);
+  if (fd == -1) { free(d.buf); return lio_fail(a, "dump-data", "open the file"); }
+  lval* x = lio_write(fd, 0, d.buf, d.len, "dump-data");
+  close(fd);
+  free(d.buf);
+  lval_free(a);
+  return x;
+}
+
+lval* builtin_mmap_data(lenv* e, lval* a) {
+  LASSERT_NUM("mmap-data", a, 1);
+  LASSERT_TYPE("mmap-data", a, 0, LVAL_STR);
+
+  struct stat st;
+  int fd = open(LPTR(a->cell[0])->str, O_RDONLY);
+  if (fd == -1) { return lio_fail(a, "mmap-data", "open the file"); }
+  if (fstat(fd, &st) == -1) { close(fd); return lio_fail(a, "mmap-data", "open the file"); }
+
+  char* base = st.st_size >= 16 ?
+    mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (base == MAP_FAILED || memcmp(base, LDATA_MAGIC, 8) != 0) {
+    if (base != MAP_FAILED) { munmap(base, st.st_size); }
+    lval* err = lval_err("Function 'mmap-data' passed '%s', which is not a data image.", LPTR(a->cell[0])->str);
+    lval_free(a);
+    return err;
+  }
+
+  ldata* m = malloc(sizeof(ldata));
+  m->refs = 1;
+  m->base = base;
+  m->size = st.st_size;
+  uint64_t root;
+  memcpy(&root, base + 8, sizeof(uint64_t));
+  lval* x = ldata_decode(m, root);
+  ldata_free(m);
+  lval_free(a);
+  return x;
+}
+
+/* Sequences */
+
+/* A sequence is an immutable chain of stages, a source (a range, an */
+/* iterated function or a list) followed by maps, filters and takes. */
+/* Nothing is computed when it is built. Consuming it walks a fresh */
+/* cursor down the chain and pulls one element at a time through all */
+/* the stages, so a pipeline runs in constant memory. A cursor that */
+/* holds the only reference to a list moves its elements out rather */
+/* than copying them. */
+
+enum {
+  LSEQ_RANGE, LSEQ_ITERATE, LSEQ_LIST, LSEQ_HOLE,
+  LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE
+};
+
+typedef struct lcursor lcursor;
+
+struct lcursor {
+  lseq* s;
+  lcursor* src;
+  int owned;
+  long i;
+  lval* x;
+};
+
+lseq* lseq_new(int kind, lseq* src) {
+  lseq* s = calloc(1, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  s->src = src;
+  return s;
+}
+
+lval* lval_seq(lseq* s) {
+  lval* v = lval_new(LVAL_SEQ);
+  v->seq = s;
+  return v;
+}
+
+void lseq_free(lseq* s) {
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+  if (s->src) { lseq_free(s->src); }
+  if (s->f) { lval_free(s->f); }
+  if (s->x) { lval_free(s->x); }
+  free(s);
+}
+
+/* Takes v as the source of a new stage, lists become sequences */
+lseq* lseq_source(lval* v) {
+  lseq* s;
+  if (v->type == LVAL_SEQ) {
+    s = v->seq;
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    lval_free(v);
+  } else {
+    s = lseq_new(LSEQ_LIST, NULL);
+    s->x = v;
+  }
+  return s;
+}
+
+lcursor* lcursor_new(lseq* s, int owned) {
+  lcursor* c = malloc(sizeof(lcursor));
+  c->s = s;
+  c->owned = owned && __atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) == 1;
+  if (c->owned && s->kind == LSEQ_LIST) { lval_own(s->x); }
+  c->src = s->src ? lcursor_new(s->src, c->owned) : NULL;
+  c->i = s->kind == LSEQ_RANGE ? s->from : 0;
+  c->x = s->kind == LSEQ_ITERATE ? lval_copy(s->x) : NULL;
+  return c;
+}
+
+void lcursor_free(lcursor* c) {
+  if (c->src) { lcursor_free(c->src); }
+  if (c->owned && c->s->kind == LSEQ_LIST) {
+    /* Drop the moved out elements */
+    lval* x = c->s->x;
+    memmove(x->cell, x->cell + c->i, sizeof(lref) * (x->count - c->i));
+    x->count -= c->i;
+    lbudget_alloc(-(long)sizeof(lref) * c->i);
+  }
+  if (c->x) { lval_free(c->x); }
+  free(c);
+}
+
+lval* lseq_apply(lenv* e, lval* f, lval* x) {
+  lval* g = lval_copy(f);
+  lval* r = lval_call(e, g, lval_add(lval_sexpr(), x));
+  lval_free(g);
+  return r;
+}
+
+/* The next element, an error, or NULL once the sequence is done */
+lval* lcursor_next(lenv* e, lcursor* c) {
+  lseq* s = c->s;
+  lval* x;
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      if (s->step > 0 ? c->i >= s->to : c->i <= s->to) { return NULL; }
+      x = lval_num(c->i);
+      c->i += s->step;
+      return x;
+
+    case LSEQ_ITERATE:
+      if (c->i++ > 0 && c->x->type != LVAL_ERR) {
+        c->x = lseq_apply(e, s->f, c->x);
+      }
+      return lval_copy(c->x);
+
+    case LSEQ_LIST:
+      if (c->i >= s->x->count) { return NULL; }
+      if (c->owned) { return LPTR(s->x->cell[c->i++]); }
+      return lval_copy(LPTR(s->x->cell[c->i++]));
+
+    case LSEQ_HOLE:
+      return lval_err("A transducer has no elements of its own, see 'into'.");
+
+    case LSEQ_MAP:
+      x = lcursor_next(e, c->src);
+      if (!x || x->type == LVAL_ERR) { return x; }
+      return lseq_apply(e, s->f, x);
+
+    case LSEQ_FILTER:
+      while ((x = lcursor_next(e, c->src))) {
+        if (x->type == LVAL_ERR) { return x; }
+        lval* keep = lseq_apply(e, s->f, lval_copy(x));
+        if (keep->type == LVAL_ERR) { lval_free(x); return keep; }
+        int kept = keep->type == LVAL_NUM && keep->num != 0;
+        lval_free(keep);
+        if (kept) { return x; }
+        lval_free(x);
+        /* Nothing might ever pass, so count the steps */
+        lval* err = lbudget_step();
+        if (err) { return err; }
+      }
+      return NULL;
+
+    case LSEQ_TAKE:
+      if (c->i >= s->to) { return NULL; }
+      c->i++;
+      return lcursor_next(e, c->src);
+  }
+  return NULL;
+}
+
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, LPTR(args->cell[index])->type == LVAL_SEQ || LPTR(args->cell[index])->type == LVAL_QEXPR, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+    func, index, ltype2name(LPTR(args->cell[index])->type), ltype2name(LVAL_SEQ), ltype2name(LVAL_QEXPR))
+
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'range' passed incorrect number of arguments. Got %i, Expected 1 to 3.", a->count);
+  UPTO(a->count) { LASSERT_TYPE("range", a, i, LVAL_NUM); }
+
+  LASSERT(a, a->count < 3 || LPTR(a->cell[2])->num != 0, "Function 'range' passed a step of 0.");
+
+  lseq* s = lseq_new(LSEQ_RANGE, NULL);
+  s->from = a->count > 1 ? LPTR(a->cell[0])->num : 0;
+  s->to = a->count > 1 ? LPTR(a->cell[1])->num : LPTR(a->cell[0])->num;
+  s->step = a->count > 2 ? LPTR(a->cell[2])->num : 1;
+  lval_free(a);
+  return lval_seq(s);
+}
+
+lval* builtin_iterate(lenv* e, lval* a) {
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+  lseq* s = lseq_new(LSEQ_ITERATE, NULL);
+  s->f = lval_pop(a, 0);
+  s->x = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_stage(lenv* e, lval* a, char* func, int kind) {
+  lval_force(a);
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
+
+  lval* f = lval_pop(a, 0);
+  lseq* s = lseq_new(kind, lseq_source(lval_take(a, 0)));
+  s->f = f;
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_map(lenv* e, lval* a) {
+  return builtin_stage(e, a, "lazy-map", LSEQ_MAP);
+}
+
+lval* builtin_lazy_filter(lenv* e, lval* a) {
+  return builtin_stage(e, a, "lazy-filter", LSEQ_FILTER);
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_SEQ("take", a, 1);
+
+  lseq* s = lseq_new(LSEQ_TAKE, lseq_source(lval_pop(a, 1)));
+  s->to = LPTR(a->cell[0])->num;
+  lval_free(a);
+  return lval_seq(s);
+}
+
+/* Adds the elements of s to the list v, giving up s */
+lval* lseq_collect(lenv* e, lseq* s, lval* v) {
+  lcursor* c = lcursor_new(s, 1);
+  lval* x;
+  while ((x = lcursor_next(e, c))) {
+    lval* err = x->type == LVAL_ERR ? x : lbudget_step();
+    if (err) {
+      if (err != x) { lval_free(x); }
+      lval_free(v);
+      v = err;
+      break;
+    }
+    lval_add(v, x);
+  }
+  lcursor_free(c);
+  lseq_free(s);
+  return v;
+}
+
+/* Folds f over the elements of s, giving up s */
+lval* lseq_reduce(lenv* e, lseq* s, lval* f, lval* acc) {
+  lcursor* c = lcursor_new(s, 1);
+  lval* x;
+  while (acc->type != LVAL_ERR && (x = lcursor_next(e, c))) {
+    lval* err = x->type == LVAL_ERR ? x : lbudget_step();
+    if (err) {
+      if (err != x) { lval_free(x); }
+      lval_free(acc);
+      acc = err;
+      break;
+    }
+    lval* g = lval_copy(f);
+    acc = lval_call(e, g, lval_add(lval_add(lval_sexpr(), acc), x));
+    lval_free(g);
+  }
+  lcursor_free(c);
+  lseq_free(s);
+  return acc;
+}
+
+lval* builtin_collect(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("collect", a, 1);
+  LASSERT_SEQ("collect", a, 0);
+  return lseq_collect(e, lseq_source(lval_take(a, 0)), lval_qexpr());
+}
+
+lval* builtin_reduce(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("reduce", a, 3);
+  LASSERT_TYPE("reduce", a, 0, LVAL_FUN);
+  LASSERT_SEQ("reduce", a, 2);
+
+  lval* f = lval_pop(a, 0);
+  lval* acc = lval_pop(a, 0);
+  acc = lseq_reduce(e, lseq_source(lval_take(a, 0)), f, acc);
+  lval_free(f);
+  return acc;
+}
+
+/* Transducers */
+
+/* A transducer is a chain of stages whose source is left open, a hole. */
+/* Applying one to a collection copies its few stage nodes on top of */
+/* the collection and runs that like any other sequence: a single pass */
+/* with nothing built between the stages, and the output list as the */
+/* only allocation that grows with the input. */
+
+int lseq_open(lseq* s) {
+  while (s->src) { s = s->src; }
+  return s->kind == LSEQ_HOLE;
+}
+
+/* The stages of t on top of src instead of its hole */
+lseq* lseq_plug(lseq* t, lseq* src) {
+  if (t->kind == LSEQ_HOLE) {
+    __atomic_add_fetch(&src->refs, 1, __ATOMIC_RELAXED);
+    return src;
+  }
+  lseq* s = lseq_new(t->kind, lseq_plug(t->src, src));
+  s->f = t->f ? lval_copy(t->f) : NULL;
+  s->to = t->to;
+  return s;
+}
+
+#define LASSERT_XFORM(func, args, index) \
+  LASSERT(args, LPTR(args->cell[index])->type == LVAL_SEQ && lseq_open(LPTR(args->cell[index])->seq), \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected Transducer.", \
+    func, index, ltype2name(LPTR(args->cell[index])->type))
+
+lval* builtin_xform(lenv* e, lval* a, char* func, int kind) {
+  int expect = kind == LSEQ_TAKE ? LVAL_NUM : LVAL_FUN;
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, expect);
+
+  lseq* s = lseq_new(kind, lseq_new(LSEQ_HOLE, NULL));
+  if (kind == LSEQ_TAKE) {
+    s->to = LPTR(a->cell[0])->num;
+    lval_free(a);
+  } else {
+    s->f = lval_take(a, 0);
+  }
+  return lval_seq(s);
+}
+
+lval* builtin_mapping(lenv* e, lval* a) {
+  return builtin_xform(e, a, "mapping", LSEQ_MAP);
+}
+
+lval* builtin_filtering(lenv* e, lval* a) {
+  return builtin_xform(e, a, "filtering", LSEQ_FILTER);
+}
+
+lval* builtin_taking(lenv* e, lval* a) {
+  return builtin_xform(e, a, "taking", LSEQ_TAKE);
+}
+
+/* Elements go through the first transducer first */
+lval* builtin_comp(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "Function 'comp' passed no arguments.");
+  UPTO(a->count) { LASSERT_XFORM("comp", a, i); }
+
+  lseq* s = lseq_source(lval_pop(a, 0));
+  while (a->count) {
+    lseq* t = lseq_plug(LPTR(a->cell[0])->seq, s);
+    lseq_free(s);
+    lval_free(lval_pop(a, 0));
+    s = t;
+  }
+  lval_free(a);
+  return lval_seq(s);
+}
+
+lval* builtin_into(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("into", a, 3);
+  LASSERT_TYPE("into", a, 0, LVAL_QEXPR);
+  LASSERT_XFORM("into", a, 1);
+  LASSERT_SEQ("into", a, 2);
+
+  lseq* src = lseq_source(lval_pop(a, 2));
+  lseq* s = lseq_plug(LPTR(a->cell[1])->seq, src);
+  lseq_free(src);
+  return lseq_collect(e, s, lval_take(a, 0));
+}
+
+lval* builtin_transduce(lenv* e, lval* a) {
+  lval_force(a);
+  LASSERT_NUM("transduce", a, 4);
+  LASSERT_XFORM("transduce", a, 0);
+  LASSERT_TYPE("transduce", a, 1, LVAL_FUN);
+  LASSERT_SEQ("transduce", a, 3);
+
+  lseq* src = lseq_source(lval_pop(a, 3));
+  lseq* s = lseq_plug(LPTR(a->cell[0])->seq, src);
+  lseq_free(src);
+  lval* acc = lval_pop(a, 2);
+  acc = lseq_reduce(e, s, LPTR(a->cell[1]), acc);
+  lval_free(a);
+  return acc;
+}
+
+/* Builtin table */
+
+/* The builtins live in a static table rather than the global env. */
+/* Every name has its own slot under FNV-1a with LBUILTIN_SEED, so a */
+/* lookup is one probe. A new builtin goes in the slot its name */
+/* hashes to, which lbuiltins_check reports at startup; if that slot */
+/* is taken it needs a new seed, one that keeps all the names in */
+/* distinct slots. Once a name is defined in any env it is marked */
+/* shadowed and looked up there first. */
+
+#define LBUILTIN_SEED 0x811d4084u
+
+lbuiltin_slot lbuiltins[1 << LBUILTIN_BITS] = {
+  [84] = { {"def"}, builtin_def }, /* Global var */
+  [125] = { {"="}, builtin_set }, /* Local var */
+  [45] = { {"fun"}, builtin_lambda },
+  [74] = { {"list"}, builtin_list },
+  [63] = { {"head"}, builtin_head },
+  [87] = { {"tail"}, builtin_tail },
+  [79] = { {"eval"}, builtin_eval },
+  [99] = { {"join"}, builtin_join },
+  [50] = { {"try"}, builtin_try },
+  [109] = { {"throw"}, builtin_throw },
+  [120] = { {"+"}, builtin_add },
+  [117] = { {"-"}, builtin_sub },
+  [119] = { {"*"}, builtin_mul },
+  [118] = { {"/"}, builtin_div },
+  [53] = { {"spawn"}, builtin_spawn },
+  [122] = { {"yield"}, builtin_yield },
+  [26] = { {"chan"}, builtin_chan },
+  [33] = { {"send"}, builtin_send },
+  [82] = { {"recv"}, builtin_recv },
+  [43] = { {"read-file"}, builtin_read_file },
+  [31] = { {"read-lines"}, builtin_read_lines },
+  [88] = { {"write-file"}, builtin_write_file },
+  [110] = { {"listen"}, builtin_listen },
+  [106] = { {"connect"}, builtin_connect },
+  [57] = { {"accept"}, builtin_accept },
+  [92] = { {"read-socket"}, builtin_read_socket },
+  [41] = { {"write-socket"}, builtin_write_socket },
+  [13] = { {"close"}, builtin_close },
+  [12] = { {"dump-data"}, builtin_dump_data },
+  [89] = { {"mmap-data"}, builtin_mmap_data },
+  [52] = { {"range"}, builtin_range },
+  [94] = { {"iterate"}, builtin_iterate },
+  [44] = { {"lazy-map"}, builtin_lazy_map },
+  [56] = { {"lazy-filter"}, builtin_lazy_filter },
+  [90] = { {"take"}, builtin_take },
+  [8] = { {"collect"}, builtin_collect },
+  [115] = { {"reduce"}, builtin_reduce },
+  [127] = { {"mapping"}, builtin_mapping },
+  [64] = { {"filtering"}, builtin_filtering },
+  [51] = { {"taking"}, builtin_taking },
+  [0] = { {"comp"}, builtin_comp },
+  [47] = { {"into"}, builtin_into },
+  [42] = { {"transduce"}, builtin_transduce },
+};
+
+int lbuiltin_index(const char* name) {
+  uint32_t h = LBUILTIN_SEED;
+  for (const char* c = name; *c; c++) { h = (h ^ (unsigned char)*c) * 16777619u; }
+  return h >> (32 - LBUILTIN_BITS);
+}
+
+lbuiltin_slot* lbuiltin_find(lname* n) {
+  if (n->buf[LNAME_SIZE-1]) { return NULL; }
+  lbuiltin_slot* b = &lbuiltins[lbuiltin_index(n->buf)];
+  return b->func && lname_eq(&b->name, n) ? b : NULL;
+}
+
+/* The slots above are written by hand, so check each name hashes */
+/* to its own slot before anything is looked up */
+void lbuiltins_check(void) {
+  UPTO(1 << LBUILTIN_BITS) {
+    lbuiltin_slot* b = &lbuiltins[i];
+    if (!b->func || lbuiltin_find(&b->name) == b) { continue; }
+    fprintf(stderr, "Builtin '%s' is in slot %i but hashes to slot %i.\n",
+      b->name.buf, i, lbuiltin_index(b->name.buf));
+    abort();
+  }
+}
+
+/* Repl */
+
+void lval_repl(lenv* e, mpc_lexer_t* l, const char* filename, long row, const char* input, FILE* out) {
+  mpc_result_t r;
+  lval* errors;
+  lval* x = lval_read(l, filename, row, input, &errors, &r);
+  lbudget_start();
+  if (!x) {
+    mpc_err_print_to(r.error, out);
+    mpc_err_delete(r.error);
+  } else if (errors->count==0) {
+    x = lval_eval(e, x);
+    lval_println_to(x, out);
+    lval_free(x);
+  } else {
+    /* Report every error, then evaluate what did parse as one line */
+    UPTO(errors->count) {
+      char* msg = lerr_format(LPTR(errors->cell[i]));
+      fprintf(out, "%s\n", msg);
+      free(msg);
+    }
+    if (x->count) {
+      x = lval_eval(e, x);
+      lval_println_to(x, out);
+    }
+    lval_free(x);
+  }
+  lval_free(errors);
+  lsched_drain(0);
+}
+
+/* Batch */
+
+/* When stdin is not a terminal it is read in large chunks. An input */
+/* is a line like in the repl, but it carries on over the next lines */
+/* while brackets are open, so forms can span several lines. */
+
+typedef struct {
+  char* buf;
+  size_t len;
+  size_t cap;
+  size_t scan;
+  int depth;
+  int str;
+  int esc;
+} lbatch;
+
+/* Finds the end of the next complete input, or returns -1 for more */
+long lbatch_next(lbatch* b) {
+  for (; b->scan < b->len; b->scan++) {
+    char c = b->buf[b->scan];
+    /* Brackets and newlines inside strings are just characters */
+    if (b->str) {
+      if (b->esc) { b->esc = 0; }
+      else if (c=='\\') { b->esc = 1; }
+      else if (c=='"') { b->str = 0; }
+      continue;
+    }
+    if (c=='"') { b->str = 1; }
+    if (c=='(' || c=='{') { b->depth++; }
+    if ((c==')' || c=='}') && b->depth > 0) { b->depth--; }
+    if (c=='\n' && b->depth==0) {
+      return b->scan++;
+    }
+  }
+  return -1;
+}
+
+void lval_batch(lenv* e, mpc_lexer_t* l, FILE* f) {
+  static char out[1 << 16];
+  setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+  lbatch b = { NULL, 0, 0, 0, 0, 0, 0 };
+  size_t start = 0;
+  long row = 0;
+  int eof = 0;
+
+  while (1) {
+    long end = lbatch_next(&b);
+
+    if (end == -1 && eof) {
+      if (start == b.len) { break; }
+      end = b.len;
+      b.scan = b.len;
+    }
+
+    if (end != -1) {
+      b.buf[end] = '\0';
+      if (b.buf[start + strspn(b.buf + start, " \t\r\f\v")] != '\0') {
+        lval_repl(e, l, "<stdin>", row, b.buf + start, stdout);
+      }
+      /* Errors are reported at their line in the file */
+      for (size_t i = start; i < (size_t)end; i++) {
+        if (b.buf[i] == '\n') { row++; }
+      }
+      row++;
+      start = end < (long)b.len ? (size_t)end + 1 : b.len;
+      continue;
+    }
+
+    /* Drop what has been evaluated and read the next chunk */
+    if (start > 0) {
+      memmove(b.buf, b.buf + start, b.len - start);
+      b.len -= start;
+      b.scan -= start;
+      start = 0;
+    }
+
+    if (b.cap - b.len < 4096) {
+      b.cap = b.cap ? b.cap * 2 : 1 << 16;
+      b.buf = realloc(b.buf, b.cap + 1);
+    }
+
+    size_t n = fread(b.buf + b.len, 1, b.cap - b.len, f);
+    b.len += n;
+    if (n == 0) { eof = 1; }
+  }
+
+  free(b.buf);
+  fflush(stdout);
+}
+
+/* Server */
+
+#ifdef __linux__
+
+/* `main --serve <socket> [prelude]` keeps one warm global environment */
+/* and answers many clients over a Unix socket. Requests and replies */
+/* are a 4 byte big endian length followed by that many bytes of text. */
+/* The main thread does all socket io from an epoll loop. Evaluation */
+/* runs on a pool of workers, one request per connection at a time, */
+/* in a child environment of the global one made for each connection. */
+
+enum {
+  LSERVER_WORKERS = 4,
+  LSERVER_EVENTS = 64,
+  LSERVER_FRAME_MAX = 1 << 24,
+  LSERVER_GRACE = 1000 /* ms tasks on io may run after their request */
+};
+
+typedef struct lconn lconn;
+
+struct lconn {
+  int fd;
+  lenv* env;
+  int busy;
+  int closed;
+  char* in;
+  size_t in_len;
+  size_t in_cap;
+  char* out;
+  size_t out_len;
+  size_t out_pos;
+  char* request;
+  char* reply;
+  size_t reply_len;
+  lconn* next;
+};
+
+typedef struct {
+  lenv* global;
+  mpc_lexer_t* lexer;
+  int epfd;
+  int wake[2];
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  lconn* jobs;
+  lconn* jobs_tail;
+  lconn* done;
+  lconn* dead;
+} lserver;
+
+void lserver_nonblock(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void* lserver_worker(void* d) {
+  lserver* s = d;
+  while (1) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->jobs) { pthread_cond_wait(&s->ready, &s->lock); }
+    lconn* c = s->jobs;
+    s->jobs = c->next;
+    if (!s->jobs) { s->jobs_tail = NULL; }
+    pthread_mutex_unlock(&s->lock);
+
+    FILE* out = open_memstream(&c->reply, &c->reply_len);
+    lval_repl(c->env, s->lexer, "<request>", 0, c->request, out);
+    /* Tasks on io must not outlive the connection's environment, and */
+    /* have a deadline even without --timeout so none pins the worker */
+    lsched_drain(LSERVER_GRACE);
+    fclose(out);
+    free(c->request);
+    c->request = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    c->next = s->done;
+    s->done = c;
+    pthread_mutex_unlock(&s->lock);
+
+    /* Wake the event loop to send the reply */
+    while (write(s->wake[1], "", 1) == -1 && errno == EINTR);
+  }
+  return NULL;
+}
+
+lconn* lconn_new(lserver* s, int fd) {
+  lconn* c = calloc(1, sizeof(lconn));
+  c->fd = fd;
+  c->env = lenv_new();
+  c->env->parent = s->global;
+  return c;
+}
+
+void lconn_free(lconn* c) {
+  lenv_free(c->env);
+  lsched_drain(0);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+/* Later events of the same epoll batch may still point at a closed */
+/* connection, so it is only freed once the whole batch is handled */
+void lconn_bury(lserver* s, lconn* c) {
+  c->next = s->dead;
+  s->dead = c;
+}
+
+void lconn_close(lserver* s, lconn* c) {
+  if (c->closed) { return; }
+  epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->closed = 1;
+  /* A worker still owns it, it is buried when the reply comes back */
+  if (!c->busy) { lconn_bury(s, c); }
+}
+
+/* Returns 0 if the connection had to be closed */
+int lconn_flush(lserver* s, lconn* c) {
+  while (c->out_pos < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_pos, c->out_len - c->out_pos, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) { continue; }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+    if (n == -1) { lconn_close(s, c); return 0; }
+    c->out_pos += n;
+  }
+
+  if (c->out_pos == c->out_len) { c->out_pos = c->out_len = 0; }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  return 1;
+}
+
+/* Hands the next complete request of a connection to the workers */
+void lconn_dispatch(lserver* s, lconn* c) {
+  if (c->busy || c->closed || c->in_len < 4) { return; }
+
+  unsigned char* h = (unsigned char*)c->in;
+  size_t len = ((size_t)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+  if (len > LSERVER_FRAME_MAX) { lconn_close(s, c); return; }
+  if (c->in_len < 4 + len) { return; }
+
+  c->request = malloc(len + 1);
+  memcpy(c->request, c->in + 4, len);
+  c->request[len] = '\0';
+  c->in_len -= 4 + len;
+  memmove(c->in, c->in + 4 + len, c->in_len);
+
+  c->busy = 1;
+  c->next = NULL;
+  pthread_mutex_lock(&s->lock);
+  if (s->jobs_tail) { s->jobs_tail->next = c; } else { s->jobs = c; }
+  s->jobs_tail = c;
+  pthread_cond_signal(&s->ready);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void lconn_read(lserver* s, lconn* c) {
+  while (1) {
+    if (c->in_cap - c->in_len < 4096) {
+      c->in_cap = c->in_cap ? c->in_cap * 2 : 8192;
+      c->in = realloc(c->in, c->in_cap);
+    }
+    ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n == -1 && errno == EINTR) { continue; }
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+    if (n <= 0) { lconn_close(s, c); return; }
+    c->in_len += n;
+  }
+  lconn_dispatch(s, c);
+}
+
+/* Queues the reply of a finished request as a frame */
+void lconn_finish(lserver* s, lconn* c) {
+  c->busy = 0;
+  if (c->closed) {
+    free(c->reply);
+    c->reply = NULL;
+    lconn_bury(s, c);
+    return;
+  }
+
+  size_t len = c->reply_len;
+  c->out = realloc(c->out, c->out_len + 4 + len);
+  unsigned char* h = (unsigned char*)c->out + c->out_len;
+  h[0] = len >> 24; h[1] = len >> 16; h[2] = len >> 8; h[3] = len;
+  memcpy(c->out + c->out_len + 4, c->reply, len);
+  c->out_len += 4 + len;
+  free(c->reply);
+  c->reply = NULL;
+
+  if (lconn_flush(s, c)) { lconn_dispatch(s, c); }
+}
+
+void lserver_accept(lserver* s, int fd) {
+  while (1) {
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd == -1 && errno == EINTR) { continue; }
+    if (cfd == -1) { return; }
+    lserver_nonblock(cfd);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = lconn_new(s, cfd);
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, cfd, &ev);
+  }
+}
+
+void lserver_complete(lserver* s) {
+  char drain[256];
+  while (read(s->wake[0], drain, sizeof(drain)) > 0);
+
+  pthread_mutex_lock(&s->lock);
+  lconn* c = s->done;
+  s->done = NULL;
+  pthread_mutex_unlock(&s->lock);
+
+  while (c) {
+    lconn* next = c->next;
+    lconn_finish(s, c);
+    c = next;
+  }
+}
+
+int lserver_run(lenv* global, mpc_lexer_t* l, const char* path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+  unlink(path);
+
+  if (fd == -1
+  || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+  || listen(fd, SOMAXCONN) == -1) {
+    perror(path);
+    return 1;
+  }
+  lserver_nonblock(fd);
+
+  /* The global environment is only read from now on */
+  global->shared = 1;
+
+  lserver s;
+  s.global = global;
+  s.lexer = l;
+  s.epfd = epoll_create1(0);
+  s.jobs = s.jobs_tail = s.done = s.dead = NULL;
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.ready, NULL);
+  if (pipe(s.wake) == -1) { perror("pipe"); return 1; }
+  lserver_nonblock(s.wake[0]);
+
+  /* The listening socket is marked by NULL and the wake pipe by the server */
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(s.epfd, EPOLL_CTL_ADD, fd, &ev);
+  ev.data.ptr = &s;
+  epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.wake[0], &ev);
+
+  UPTO(LSERVER_WORKERS) {
+    pthread_t t;
+    pthread_create(&t, NULL, lserver_worker, &s);
+    pthread_detach(t);
+  }
+
+  printf("Lispy serving on %s\n", path);
+  fflush(stdout);
+
+  struct epoll_event evs[LSERVER_EVENTS];
+  while (1) {
+    int n = epoll_wait(s.epfd, evs, LSERVER_EVENTS, -1);
+    UPTO(n) {
+      if (evs[i].data.ptr == NULL) { lserver_accept(&s, fd); continue; }
+      if (evs[i].data.ptr == &s) { lserver_complete(&s); continue; }
+      lconn* c = evs[i].data.ptr;
+      if (c->closed) { continue; }
+      if (evs[i].events & EPOLLOUT && !lconn_flush(&s, c)) { continue; }
+      if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) { lconn_read(&s, c); }
+    }
+    while (s.dead) {
+      lconn* c = s.dead;
+      s.dead = c->next;
+      lconn_free(c);
+    }
+  }
+
+  return 0;
+}
+
+#endif
+
+/* Benchmarks */
+
+/* Builds a tree of n numbers, at most four to a list, */
+/* then sums it a few times over. Compare with --huge-pages. */
+
+lval* lbench_tree(long* next, long n) {
+  lval* x = lval_qexpr();
+  if (n <= LVAL_SMALL) {
+    UPTO(n) { x = lval_add(x, lval_num((*next)++)); }
+    return x;
+  }
+  UPTO(LVAL_SMALL) {
+    x = lval_add(x, lbench_tree(next, n / LVAL_SMALL + (i < n % LVAL_SMALL)));
+  }
+  return x;
+}
+
+long lbench_sum(lval* x) {
+  if (x->type == LVAL_NUM) { return x->num; }
+  long sum = 0;
+  UPTO(x->count) { sum += lbench_sum(LPTR(x->cell[i])); }
+  return sum;
+}
+
+void lbench_walk(long n) {
+  enum { ROUNDS = 10 };
+  struct timespec start, end;
+  long next = 0;
+  long sum = 0;
+  lval* x = lbench_tree(&next, n);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  UPTO(ROUNDS) { sum += lbench_sum(x); }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Walked %li numbers %i times in %.3fs, %.1fM numbers/s.\n",
+    n, ROUNDS, secs, n * ROUNDS / secs / 1e6);
+  printf("Heap of %li chunks, %li of them huge pages. Sum %li.\n",
+    heap.chunks, heap.huge_chunks, sum);
+  lval_free(x);
+}
+
+/* Every thread allocates and frees numbers a thousand at a time. */
+/* Throughput should grow with --alloc-bench THREADS. */
+
+enum { LBENCH_LIVE = 1000, LBENCH_ROUNDS = 10000 };
+
+void* lbench_allocs(void* d) {
+  lval* live[LBENCH_LIVE];
+  UPTO(LBENCH_ROUNDS) {
+    for (int j = 0; j < LBENCH_LIVE; j++) { live[j] = lval_num(j); }
+    for (int j = 0; j < LBENCH_LIVE; j++) { lval_free(live[j]); }
+  }
+  lheap_flush();
+  return d;
+}
+
+void lbench_alloc(int threads) {
+  struct timespec start, end;
+  pthread_t* ts = malloc(sizeof(pthread_t) * threads);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  UPTO(threads) { pthread_create(&ts[i], NULL, lbench_allocs, NULL); }
+  UPTO(threads) { pthread_join(ts[i], NULL); }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  long n = (long)threads * LBENCH_ROUNDS * LBENCH_LIVE;
+  printf("%i threads made %li values in %.3fs, %.1fM values/s.\n",
+    threads, n, secs, n / secs / 1e6);
+  free(ts);
+}
+
+/* Main */
 
 int main(int argc, const char *argv[])
 {
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
+  mpc_parser_t* String = mpc_new("string");
   mpc_parser_t* Sexpr = mpc_new("sexpr");
   mpc_parser_t* Qexpr = mpc_new("qexpr");
   mpc_parser_t* Expr = mpc_new("expr");
   mpc_parser_t* Lispy = mpc_new("lispy");
 
-  mpca_lang(MPCA_LANG_DEFAULT,
+  mpca_lang(MPCA_LANG_LEXER,
       " \
         number : /-?[0-9]+/ ; \
         symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+        string : /\"(\\\\.|[^\"])*\"/ ; \
         sexpr : '(' <expr>* ')' ; \
         qexpr : '{' <expr>* '}' ; \
-        expr : <number> | <symbol> | <sexpr> | <qexpr> ; \
-        lispy : /^/ <expr>* /$/ ; \
+        expr : <number> | <symbol> | <string> | <sexpr> | <qexpr> ; \
       ",
-      Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  
-  puts("Lispy Version 0.0.1");
-  puts("Press Ctrl+c to Exit\n");
+      Number, Symbol, String, Sexpr, Qexpr, Expr);
+
+  /* Keep reading past broken forms so every error is reported */
+  mpc_define(Lispy, mpca_total(mpc_many(mpcf_fold_ast,
+    mpca_recover(Expr, "({", ")}", "\"", '\\'))));
+
+  mpc_lexer_t* Lexer = mpc_lexer_new(Lispy);
+
+  /* Limits for every evaluation: --steps N, --memory BYTES, --timeout MS */
+  /* and the heap options: --huge-pages, --walk-bench N, --alloc-bench THREADS */
+  int arg = 1;
+  long walk = 0;
+  int threads = 0;
+  while (arg < argc) {
+    if (strcmp(argv[arg], "--huge-pages")==0) { heap.huge = 1; arg++; continue; }
+    if (arg + 1 >= argc) { break; }
+    if (strcmp(argv[arg], "--steps")==0) { limits.steps = atol(argv[arg+1]); }
+    else if (strcmp(argv[arg], "--memory")==0) { limits.bytes = atol(argv[arg+1]); }
+    else if (strcmp(argv[arg], "--timeout")==0) { limits.millis = atol(argv[arg+1]); }
+    else if (strcmp(argv[arg], "--walk-bench")==0) { walk = atol(argv[arg+1]); }
+    else if (strcmp(argv[arg], "--alloc-bench")==0) { threads = atoi(argv[arg+1]); }
+    else { break; }
+    arg += 2;
+  }
+
+  lbuiltins_check();
+  lheap_init();
+  if (walk > 0 || threads > 0) {
+    if (walk > 0) { lbench_walk(walk); }
+    if (threads > 0) { lbench_alloc(threads); }
+    mpc_lexer_delete(Lexer);
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+    return 0;
+  }
 
   lenv* e = lenv_new();
-  lenv_add_builtins(e);
 
-  while (1) {
-    char* input = readline("lispy> ");
-    add_history(input);
+  if (arg + 1 < argc && strcmp(argv[arg], "--serve")==0) {
+    int status = 1;
+#ifdef __linux__
+    FILE* prelude = arg + 2 < argc ? fopen(argv[arg+2], "r") : NULL;
+    if (arg + 2 < argc && !prelude) { perror(argv[arg+2]); }
+    if (prelude) {
+      lval_batch(e, Lexer, prelude);
+      fclose(prelude);
+    }
+    status = lserver_run(e, Lexer, argv[arg+1]);
+#else
+    fputs("Server mode is only available on Linux.\n", stderr);
+#endif
+    lenv_free(e);
+    lenv_pool_clear();
+    lheap_flush();
+    mpc_lexer_delete(Lexer);
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+    return status;
+  }
 
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* x = lval_eval(e, lval_read(r.output));
-      lval_println(x);
-      lval_free(x);
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+  if (!isatty(STDIN_FILENO)) {
+    lval_batch(e, Lexer, stdin);
+  } else {
+    puts("Lispy Version 0.0.1");
+    puts("Press Ctrl+c to Exit\n");
+
+    while (1) {
+      char* input = readline("lispy> ");
+      if (!input) { break; }
+      add_history(input);
+      lval_repl(e, Lexer, "<stdin>", 0, input, stdout);
+      free(input);
     }
-    free(input);
   }
 
+  /* Let the tasks still waiting on io finish */
+  lbudget_start();
+  lsched_drain(-1);
   lenv_free(e);
+  lsched_drain(0);
+  lenv_pool_clear();
+  lheap_flush();
 
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  mpc_lexer_delete(Lexer);
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
   return 0;
 }
 
@@ -53,6 +53,13 @@ static mpc_state_t mpc_state_new(void) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Only the byte offset is tracked while parsing.
+** Rows and columns are worked out from an index
+** of line starts when an error or a state is
+** asked for. Strings build the index lazily by
+** scanning ahead, while files and pipes note
+** each newline the first time it is read.
+**
 */
 
 enum {
@@ -73,11 +80,38 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+  const char *k;
+  long pos;
+  long len;
+  long next;
+} mpc_token_t;
+
+enum {
+  MPC_EVENT_ENTER    = 0,
+  MPC_EVENT_LEAVE    = 1,
+  MPC_EVENT_TERMINAL = 2,
+  MPC_EVENT_STATE    = 3
+};
+
+typedef struct {
+  int type;
+  const char *tag;
+  size_t text;
+  long pos;
+} mpc_event_t;
+
 typedef struct {
 
   int type;
   char *filename;  
-  mpc_state_t state;
+  long pos;
+  long row;
+  
+  int lines_num;
+  int lines_slots;
+  long lines_end;
+  long *lines;
   
   char *string;
   char *buffer;
@@ -87,11 +121,24 @@ typedef struct {
   int backtrack;
   int marks_slots;
   int marks_num;
-  mpc_state_t *marks;
+  long *marks;
   
   char *lasts;
   char last;
   
+  int visit;
+  int events_num;
+  int events_slots;
+  int *events_marks;
+  mpc_event_t *events;
+  size_t text_num;
+  size_t text_slots;
+  char *text;
+  
+  int tokens_num;
+  int tokens_curr;
+  mpc_token_t *tokens;
+  
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -106,7 +153,12 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
   
-  i->state = mpc_state_new();
+  i->pos = 0;
+  i->row = 0;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines = NULL;
   
   i->string = malloc(strlen(string) + 1);
   strcpy(i->string, string);
@@ -117,10 +169,23 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->marks = malloc(sizeof(long) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->visit = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_marks = malloc(sizeof(int) * i->marks_slots);
+  i->events = NULL;
+  i->text_num = 0;
+  i->text_slots = 0;
+  i->text = NULL;
+  
+  i->tokens_num = 0;
+  i->tokens_curr = 0;
+  i->tokens = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -135,7 +200,12 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_STRING;
   
-  i->state = mpc_state_new();
+  i->pos = 0;
+  i->row = 0;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines = NULL;
   
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
@@ -147,10 +217,23 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->marks = malloc(sizeof(long) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->visit = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_marks = malloc(sizeof(int) * i->marks_slots);
+  i->events = NULL;
+  i->text_num = 0;
+  i->text_slots = 0;
+  i->text = NULL;
+  
+  i->tokens_num = 0;
+  i->tokens_curr = 0;
+  i->tokens = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -166,7 +249,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   strcpy(i->filename, filename);
   
   i->type = MPC_INPUT_PIPE;
-  i->state = mpc_state_new();
+  i->pos = 0;
+  i->row = 0;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines = NULL;
   
   i->string = NULL;
   i->buffer = NULL;
@@ -176,10 +264,23 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->marks = malloc(sizeof(long) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->visit = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_marks = malloc(sizeof(int) * i->marks_slots);
+  i->events = NULL;
+  i->text_num = 0;
+  i->text_slots = 0;
+  i->text = NULL;
+  
+  i->tokens_num = 0;
+  i->tokens_curr = 0;
+  i->tokens = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -194,7 +295,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
   i->type = MPC_INPUT_FILE;
-  i->state = mpc_state_new();
+  i->pos = 0;
+  i->row = 0;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines = NULL;
   
   i->string = NULL;
   i->buffer = NULL;
@@ -204,10 +310,23 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
+  i->marks = malloc(sizeof(long) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->visit = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_marks = malloc(sizeof(int) * i->marks_slots);
+  i->events = NULL;
+  i->text_num = 0;
+  i->text_slots = 0;
+  i->text = NULL;
+  
+  i->tokens_num = 0;
+  i->tokens_curr = 0;
+  i->tokens = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -221,8 +340,13 @@ static void mpc_input_delete(mpc_input_t *i) {
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  free(i->lines);
   free(i->marks);
   free(i->lasts);
+  free(i->events_marks);
+  free(i->events);
+  free(i->text);
+  free(i->tokens);
   free(i);
 }
 
@@ -296,19 +420,82 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+/*
+** When visiting, the parse records a flat log
+** of enter, leave and terminal events instead
+** of building an AST. Terminal contents are
+** copied into a single text buffer. Anything
+** logged by a branch that gets backtracked is
+** truncated away again on rewind, so once the
+** parse succeeds the log is exactly the tree.
+** A state parser logs its own event, and at
+** replay its position goes to the node which
+** opens right after it.
+*/
+
+static mpc_event_t *mpc_input_event(mpc_input_t *i, int type, const char *tag) {
+  
+  mpc_event_t *v;
+  
+  if (i->events_num == i->events_slots) {
+    i->events_slots = i->events_slots == 0 ? MPC_INPUT_MARKS_MIN : i->events_slots * 2;
+    i->events = realloc(i->events, sizeof(mpc_event_t) * i->events_slots);
+  }
+  
+  v = &i->events[i->events_num++];
+  v->type = type;
+  v->tag = tag;
+  v->text = i->text_num;
+  v->pos = i->pos;
+  return v;
+}
+
+static void mpc_input_event_text(mpc_input_t *i, const char *c) {
+  
+  size_t l = strlen(c) + 1;
+  
+  mpc_input_event(i, MPC_EVENT_TERMINAL, "");
+  
+  if (i->text_num + l > i->text_slots) {
+    i->text_slots = i->text_num + l + (i->text_num + l) / 2;
+    i->text = realloc(i->text, i->text_slots);
+  }
+  
+  memcpy(i->text + i->text_num, c, l);
+  i->text_num += l;
+}
+
+static void mpc_input_events_truncate(mpc_input_t *i, int n) {
+  if (n >= i->events_num) { return; }
+  i->text_num = i->events[n].text;
+  i->events_num = n;
+}
+
+/*
+** The mark stack only ever grows during a parse,
+** so deep nesting never bounces between growing
+** and shrinking it. Strings need nothing but the
+** offset: the last character can be read back
+** from the string and there is nothing to buffer.
+*/
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->marks_num++;
-  
-  if (i->marks_num > i->marks_slots) {
-    i->marks_slots = i->marks_num + i->marks_num / 2;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots *= 2;
+    i->marks = realloc(i->marks, sizeof(long) * i->marks_slots);
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    i->events_marks = realloc(i->events_marks, sizeof(int) * i->marks_slots);
   }
-
-  i->marks[i->marks_num-1] = i->state;
+  
+  i->marks[i->marks_num] = i->pos;
+  i->events_marks[i->marks_num] = i->events_num;
+  i->marks_num++;
+  
+  if (i->type == MPC_INPUT_STRING) { return; }
+  
   i->lasts[i->marks_num-1] = i->last;
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
@@ -323,15 +510,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   
   i->marks_num--;
   
-  if (i->marks_slots > i->marks_num + i->marks_num / 2
-  &&  i->marks_slots > MPC_INPUT_MARKS_MIN) {
-    i->marks_slots = 
-      i->marks_num > MPC_INPUT_MARKS_MIN ?
-      i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);      
-  }
-  
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
     free(i->buffer);
     i->buffer = NULL;
@@ -343,26 +521,33 @@ static void mpc_input_rewind(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->state = i->marks[i->marks_num-1];
-  i->last  = i->lasts[i->marks_num-1];
+  i->pos = i->marks[i->marks_num-1];
+  
+  if (i->type == MPC_INPUT_STRING) {
+    i->last = i->pos > 0 ? i->string[i->pos-1] : '\0';
+  } else {
+    i->last = i->lasts[i->marks_num-1];
+  }
+  
+  mpc_input_events_truncate(i, i->events_marks[i->marks_num-1]);
   
   if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
+    fseek(i->file, i->pos, SEEK_SET);
   }
   
   mpc_input_unmark(i);
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->pos < (long)(strlen(i->buffer) + i->marks[0]);
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->pos - i->marks[0]];
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string[i->pos] == '\0') { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -374,7 +559,7 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->string[i->pos];
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
@@ -397,7 +582,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING: return i->string[i->pos];
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -429,6 +614,38 @@ static char mpc_input_peekc(mpc_input_t *i) {
   
 }
 
+static void mpc_input_line(mpc_input_t *i, long start) {
+  if (i->lines_num == i->lines_slots) {
+    i->lines_slots = i->lines_slots == 0 ? MPC_INPUT_MARKS_MIN : i->lines_slots * 2;
+    i->lines = realloc(i->lines, sizeof(long) * i->lines_slots);
+  }
+  i->lines[i->lines_num++] = start;
+}
+
+static mpc_state_t mpc_input_state_at(mpc_input_t *i, long pos) {
+  
+  mpc_state_t s;
+  int lo = 0, hi, mid;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    while (i->lines_end < pos) {
+      if (i->string[i->lines_end++] == '\n') { mpc_input_line(i, i->lines_end); }
+    }
+  }
+  
+  /* Count the line starts at or before `pos` */
+  hi = i->lines_num;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (i->lines[mid] <= pos) { lo = mid+1; } else { hi = mid; }
+  }
+  
+  s.pos = pos;
+  s.row = i->row + lo;
+  s.col = lo == 0 ? pos : pos - i->lines[lo-1];
+  return s;
+}
+
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
@@ -459,12 +676,11 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   }
   
   i->last = c;
-  i->state.pos++;
-  i->state.col++;
+  i->pos++;
   
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
+  if (i->type != MPC_INPUT_STRING && i->pos > i->lines_end) {
+    if (c == '\n') { mpc_input_line(i, i->pos); }
+    i->lines_end = i->pos;
   }
   
   if (o) {
@@ -536,9 +752,71 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   return f(i->last, mpc_input_peekc(i));
 }
 
+static void mpc_input_strip(mpc_input_t *i) {
+  while (mpc_input_oneof(i, " \f\n\r\t\v", NULL)) { }
+}
+
+/*
+** When the input has been run through a lexer
+** terminals no longer need to be matched
+** character by character. The token starting
+** at the current position (if any) is looked
+** up and compared against the key of the
+** terminal. Returns -1 if there is no token
+** here, or it was lexed as another terminal
+** which this one could also match a prefix
+** of, and the terminal must be run as normal.
+*/
+
+static mpc_token_t *mpc_input_token(mpc_input_t *i) {
+  
+  int lo = 0, hi = i->tokens_num-1, mid;
+  
+  if (i->tokens_curr < i->tokens_num
+  &&  i->tokens[i->tokens_curr].pos == i->pos) {
+    return &i->tokens[i->tokens_curr];
+  }
+  
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (i->tokens[mid].pos == i->pos) { i->tokens_curr = mid; return &i->tokens[mid]; }
+    if (i->tokens[mid].pos < i->pos) { lo = mid+1; } else { hi = mid-1; }
+  }
+  
+  return NULL;
+}
+
+static int mpc_input_lexeme(mpc_input_t *i, const char *k, const char *firsts, char **o) {
+  
+  mpc_token_t *t;
+  
+  if (i->tokens == NULL) { return -1; }
+  
+  t = mpc_input_token(i);
+  if (t == NULL) { return -1; }
+  if (t->k != k && strcmp(t->k, k) != 0) {
+    return firsts[(unsigned char)i->string[t->pos]] ? -1 : 0;
+  }
+  
+  *o = mpc_malloc(i, t->len + 1);
+  memcpy(*o, i->string + t->pos, t->len);
+  (*o)[t->len] = '\0';
+  
+  i->last = i->string[t->next-1];
+  i->pos = t->next;
+  i->tokens_curr++;
+  return 1;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
-  memcpy(r, &i->state, sizeof(mpc_state_t));
+  if (i->visit) {
+    /* Events only keep the offset, rows and columns come at replay */
+    *r = mpc_state_invalid();
+    r->pos = i->pos;
+  } else {
+    *r = mpc_input_state_at(i, i->pos);
+  }
   return r;
 }
 
@@ -575,9 +853,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -604,6 +880,7 @@ static const char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
 
   int i;  
+  char unescape[4];
   int pos = 0; 
   int max = 1023;
   char *buffer = calloc(1, 1024);
@@ -631,7 +908,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, unescape));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -643,7 +920,8 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
-  x->state = i->state;
+  x->state = mpc_state_invalid();
+  x->state.pos = i->pos;
   x->expected_num = 1;
   x->expected = mpc_malloc(i, sizeof(char*));
   x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
@@ -659,7 +937,8 @@ static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
-  x->state = i->state;
+  x->state = mpc_state_invalid();
+  x->state.pos = i->pos;
   x->expected_num = 0;
   x->expected = NULL;
   x->failure = mpc_malloc(i, strlen(failure) + 1);
@@ -692,8 +971,13 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
   mpc_free(i, x);
 }
 
+static void mpc_err_locate(mpc_input_t *i, mpc_err_t *x) {
+  if (x->state.pos >= 0) { x->state = mpc_input_state_at(i, x->state.pos); }
+}
+
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
+  mpc_err_locate(i, x);
   for (j = 0; j < x->expected_num; j++) {
     x->expected[j] = mpc_export(i, x->expected[j]);
   }
@@ -882,7 +1166,10 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_LEXEME    = 25,
+  MPC_TYPE_RECOVER   = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -900,6 +1187,8 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; char *k; int strip; int lexable; char *firsts; } mpc_pdata_lexeme_t;
+typedef struct { mpc_parser_t *x; char *o; char *c; char *q; char esc; } mpc_pdata_recover_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -917,6 +1206,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_lexeme_t lexeme;
+  mpc_pdata_recover_t recover;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -966,6 +1257,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast && i->visit) { return NULL; }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -981,13 +1273,28 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
   return a;
 }
 
+static mpc_val_t *mpcf_input_str_event(mpc_input_t *i, mpc_val_t *c) {
+  mpc_input_event_text(i, c);
+  mpc_free(i, c);
+  return NULL;
+}
+
+static mpc_val_t *mpcf_input_tag_event(mpc_input_t *i, mpc_val_t *x, void *t) {
+  if (i->events_num > 0
+  &&  i->events[i->events_num-1].type == MPC_EVENT_TERMINAL) {
+    i->events[i->events_num-1].tag = t;
+  }
+  return x;
+}
+
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == mpcf_str_ast)  { return i->visit ? mpcf_input_str_event(i, x) : mpcf_input_str_ast(i, x); }
   return f(mpc_export(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (f == (mpc_apply_to_t)mpc_ast_tag && i->visit) { return mpcf_input_tag_event(i, x, d); }
   return f(mpc_export(i, x), d);
 }
 
@@ -996,6 +1303,80 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Recovery turns a syntax error into a value.
+** The furthest error is formatted, the input is
+** skipped up to the end of the broken form (as
+** far as the delimiters balance, then to the
+** end of that word) and parsing carries on.
+** Strings, opened and closed by one of the
+** quotes in `q`, are skipped whole so that
+** delimiters inside them are not counted.
+*/
+
+static void mpc_input_skip_string(mpc_input_t *i, char q, char esc) {
+  
+  char x;
+  
+  while (1) {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { return; }
+    mpc_input_success(i, x, NULL);
+    if (x == q) { return; }
+    if (esc != '\0' && x == esc) {
+      x = mpc_input_getc(i);
+      if (mpc_input_terminated(i)) { return; }
+      mpc_input_success(i, x, NULL);
+    }
+  }
+}
+
+static void mpc_input_skip(mpc_input_t *i, const char *o, const char *c, const char *q, char esc) {
+  
+  int depth = 0;
+  char x;
+  
+  do {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    mpc_input_success(i, x, NULL);
+    if (strchr(q, x)) { mpc_input_skip_string(i, x, esc); }
+    if (strchr(o, x)) { depth++; }
+    if (strchr(c, x)) { depth--; }
+    x = mpc_input_peekc(i);
+  } while (depth > 0 || (depth == 0 && x != '\0'
+    && !strchr(" \f\n\r\t\v", x) && !strchr(o, x) && !strchr(c, x)));
+  
+  mpc_input_strip(i);
+}
+
+static mpc_val_t *mpc_input_recover(mpc_input_t *i, mpc_pdata_recover_t *d, mpc_err_t **e, mpc_err_t *x) {
+  
+  char *msg;
+  mpc_ast_t *a = NULL;
+  mpc_err_t *err = mpc_err_merge(i, *e, x);
+  
+  *e = mpc_err_fail(i, "Unknown Error");
+  if (*e) { (*e)->state = mpc_state_invalid(); }
+  
+  if (err) { mpc_err_locate(i, err); }
+  msg = err ? mpc_err_string(err) : mpc_err_string(*e);
+  
+  if (i->visit) {
+    mpc_input_event_text(i, msg);
+    i->events[i->events_num-1].tag = "error";
+    if (err) { i->events[i->events_num-1].pos = err->state.pos; }
+  } else {
+    a = mpc_ast_new("error", msg);
+    if (err) { a->state = err->state; }
+  }
+  
+  free(msg);
+  mpc_err_delete_internal(i, err);
+  mpc_input_skip(i, d->o, d->c, d->q, d->esc);
+  return a;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1033,7 +1414,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
     case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    case MPC_TYPE_STATE:
+      if (i->visit) { mpc_input_event(i, MPC_EVENT_STATE, NULL); }
+      MPC_SUCCESS(mpc_input_state_copy(i));
     
     /* Application Parsers */
     
@@ -1045,6 +1428,17 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
     
     case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag && i->visit) {
+        k = i->events_num;
+        mpc_input_event(i, MPC_EVENT_ENTER, p->data.apply_to.d);
+        if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+          mpc_input_event(i, MPC_EVENT_LEAVE, p->data.apply_to.d);
+          MPC_SUCCESS(r->output);
+        } else {
+          mpc_input_events_truncate(i, k);
+          MPC_FAILURE(r->error);
+        }
+      }
       if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
@@ -1217,6 +1611,40 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
         if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
     
+    /* Lexer Parsers */
+    
+    case MPC_TYPE_LEXEME:
+      
+      if (p->data.lexeme.lexable) {
+        switch (mpc_input_lexeme(i, p->data.lexeme.k, p->data.lexeme.firsts, (char**)&r->output)) {
+          case 1: MPC_SUCCESS(r->output);
+          case 0: MPC_FAILURE(mpc_err_new(i, p->data.lexeme.k));
+          default: break;
+        }
+      }
+      
+      if (!mpc_parse_run(i, p->data.lexeme.x, r, e)) {
+        MPC_FAILURE(r->error);
+      }
+      
+      if (p->data.lexeme.strip) { mpc_input_strip(i); }
+      MPC_SUCCESS(r->output);
+    
+    /* Recovery Parsers */
+    
+    case MPC_TYPE_RECOVER:
+      
+      mpc_input_mark(i);
+      if (mpc_parse_run(i, p->data.recover.x, r, e)) {
+        mpc_input_unmark(i);
+        MPC_SUCCESS(r->output);
+      }
+      mpc_input_rewind(i);
+      
+      if (mpc_input_terminated(i)) { MPC_FAILURE(r->error); }
+      
+      MPC_SUCCESS(mpc_input_recover(i, &p->data.recover, e, r->error));
+    
     /* End */
     
     default:
@@ -1294,6 +1722,268 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Lexer
+*/
+
+/*
+** The lexer is an optional first stage for
+** string inputs. Before the grammar is run all
+** of the lexeme terminals reachable from the
+** root parser are scanned over the input in a
+** single pass, taking the longest match at each
+** position (ties go to the terminal found first
+** from the root) and skipping whitespace after
+** terminals that strip.
+**
+** To avoid trying every terminal at every
+** position each terminal is given a table of
+** the characters it can start with, so at each
+** position only the candidates for the next
+** character are run.
+**
+** When the grammar then reaches a lexeme it is
+** just a lookup in the token array. A token only
+** stands in for the terminal it was lexed as.
+** Other terminals at that position, positions
+** the lexer never reached, and terminals which
+** can match the empty string, fall back to
+** running the terminal as usual, so ordered
+** choice in the grammar decides between them
+** exactly as it would without the lexer.
+*/
+
+struct mpc_lexer_t {
+  mpc_parser_t *root;
+  int terms_num;
+  mpc_parser_t **terms;
+  char (*firsts)[256];
+};
+
+static void mpc_firsts_all(char *set) {
+  memset(set, 1, 256);
+  set[0] = 0;
+}
+
+static int mpc_firsts(mpc_parser_t *p, char *set) {
+  
+  int j, nullable;
+  const char *c;
+  
+  if (p->retained) { mpc_firsts_all(set); return 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:     mpc_firsts_all(set); return 0;
+    case MPC_TYPE_SATISFY: mpc_firsts_all(set); return 0;
+    case MPC_TYPE_SINGLE:  set[(unsigned char)p->data.single.x] = 1; return 0;
+    
+    case MPC_TYPE_RANGE:
+      for (j = (unsigned char)p->data.range.x; j <= (unsigned char)p->data.range.y; j++) { set[j] = 1; }
+      return 0;
+    
+    case MPC_TYPE_ONEOF:
+      for (c = p->data.string.x; *c; c++) { set[(unsigned char)*c] = 1; }
+      return 0;
+    
+    case MPC_TYPE_NONEOF:
+      for (j = 1; j < 256; j++) { if (!strchr(p->data.string.x, j)) { set[j] = 1; } }
+      return 0;
+    
+    case MPC_TYPE_STRING:
+      set[(unsigned char)p->data.string.x[0]] = 1;
+      return p->data.string.x[0] == '\0';
+    
+    case MPC_TYPE_EXPECT:   return mpc_firsts(p->data.expect.x, set);
+    case MPC_TYPE_APPLY:    return mpc_firsts(p->data.apply.x, set);
+    case MPC_TYPE_APPLY_TO: return mpc_firsts(p->data.apply_to.x, set);
+    case MPC_TYPE_PREDICT:  return mpc_firsts(p->data.predict.x, set);
+    case MPC_TYPE_LEXEME:   return mpc_firsts(p->data.lexeme.x, set);
+    
+    case MPC_TYPE_MAYBE: mpc_firsts(p->data.not.x, set); return 1;
+    case MPC_TYPE_MANY:  mpc_firsts(p->data.repeat.x, set); return 1;
+    
+    case MPC_TYPE_MANY1: return mpc_firsts(p->data.repeat.x, set);
+    
+    case MPC_TYPE_COUNT:
+      nullable = mpc_firsts(p->data.repeat.x, set);
+      return nullable || p->data.repeat.n == 0;
+    
+    case MPC_TYPE_OR:
+      nullable = p->data.or.n == 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        nullable = mpc_firsts(p->data.or.xs[j], set) || nullable;
+      }
+      return nullable;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_firsts(p->data.and.xs[j], set)) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_UNDEFINED:
+      return 0;
+    
+    default: return 1;
+  }
+  
+}
+
+static int mpc_lexer_seen(mpc_parser_t ***seen, int *seen_num, mpc_parser_t *p) {
+  int j;
+  for (j = 0; j < *seen_num; j++) { if ((*seen)[j] == p) { return 1; } }
+  (*seen_num)++;
+  *seen = realloc(*seen, sizeof(mpc_parser_t*) * (*seen_num));
+  (*seen)[(*seen_num)-1] = p;
+  return 0;
+}
+
+static void mpc_lexer_add(mpc_lexer_t *l, mpc_parser_t *p) {
+  
+  int j;
+  
+  if (!p->data.lexeme.lexable) { return; }
+  
+  for (j = 0; j < l->terms_num; j++) {
+    if (strcmp(l->terms[j]->data.lexeme.k, p->data.lexeme.k) == 0) { return; }
+  }
+  
+  l->terms_num++;
+  l->terms = realloc(l->terms, sizeof(mpc_parser_t*) * l->terms_num);
+  l->firsts = realloc(l->firsts, sizeof(char[256]) * l->terms_num);
+  l->terms[l->terms_num-1] = p;
+  memset(l->firsts[l->terms_num-1], 0, 256);
+  mpc_firsts(p->data.lexeme.x, l->firsts[l->terms_num-1]);
+}
+
+static void mpc_lexer_collect(mpc_lexer_t *l, mpc_parser_t *p, mpc_parser_t ***seen, int *seen_num) {
+  
+  int j;
+  
+  if (p->retained && mpc_lexer_seen(seen, seen_num, p)) { return; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LEXEME:   mpc_lexer_add(l, p); break;
+    
+    case MPC_TYPE_EXPECT:   mpc_lexer_collect(l, p->data.expect.x, seen, seen_num); break;
+    case MPC_TYPE_APPLY:    mpc_lexer_collect(l, p->data.apply.x, seen, seen_num); break;
+    case MPC_TYPE_APPLY_TO: mpc_lexer_collect(l, p->data.apply_to.x, seen, seen_num); break;
+    case MPC_TYPE_PREDICT:  mpc_lexer_collect(l, p->data.predict.x, seen, seen_num); break;
+    case MPC_TYPE_RECOVER:  mpc_lexer_collect(l, p->data.recover.x, seen, seen_num); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_lexer_collect(l, p->data.not.x, seen, seen_num);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_lexer_collect(l, p->data.repeat.x, seen, seen_num);
+      break;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_lexer_collect(l, p->data.or.xs[j], seen, seen_num); }
+      break;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_lexer_collect(l, p->data.and.xs[j], seen, seen_num); }
+      break;
+    
+    default: break;
+  }
+  
+}
+
+mpc_lexer_t *mpc_lexer_new(mpc_parser_t *p) {
+  
+  int seen_num = 0;
+  mpc_parser_t **seen = NULL;
+  
+  mpc_lexer_t *l = malloc(sizeof(mpc_lexer_t));
+  l->root = p;
+  l->terms_num = 0;
+  l->terms = NULL;
+  l->firsts = NULL;
+  
+  mpc_lexer_collect(l, p, &seen, &seen_num);
+  free(seen);
+  
+  return l;
+}
+
+void mpc_lexer_delete(mpc_lexer_t *l) {
+  free(l->terms);
+  free(l->firsts);
+  free(l);
+}
+
+static void mpc_input_lex(mpc_input_t *i, mpc_lexer_t *l) {
+  
+  int j, best, slots = 0;
+  unsigned char c;
+  long pos, end;
+  mpc_result_t r;
+  mpc_err_t *e = NULL;
+  mpc_token_t *t;
+  
+  mpc_input_suppress_enable(i);
+  mpc_input_strip(i);
+  
+  while (!mpc_input_terminated(i)) {
+    
+    c = (unsigned char)mpc_input_peekc(i);
+    pos = i->pos;
+    best = -1;
+    end = i->pos;
+    
+    for (j = 0; j < l->terms_num; j++) {
+      if (!l->firsts[j][c]) { continue; }
+      mpc_input_mark(i);
+      if (mpc_parse_run(i, l->terms[j]->data.lexeme.x, &r, &e)) {
+        mpc_free(i, r.output);
+        if (i->pos > end) { best = j; end = i->pos; }
+      }
+      mpc_input_rewind(i);
+    }
+    
+    if (best == -1) { break; }
+    
+    i->pos = end;
+    i->last = i->string[end-1];
+    if (l->terms[best]->data.lexeme.strip) { mpc_input_strip(i); }
+    
+    if (i->tokens_num == slots) {
+      slots = slots == 0 ? MPC_INPUT_MARKS_MIN : slots * 2;
+      i->tokens = realloc(i->tokens, sizeof(mpc_token_t) * slots);
+    }
+    
+    t = &i->tokens[i->tokens_num++];
+    t->k = l->terms[best]->data.lexeme.k;
+    t->pos = pos;
+    t->len = end - pos;
+    t->next = i->pos;
+  }
+  
+  mpc_input_suppress_disable(i);
+  
+  i->pos = 0;
+  i->last = '\0';
+  i->tokens_curr = 0;
+}
+
+int mpc_lex_parse(const char *filename, const char *string, mpc_lexer_t *l, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_lex(i, l);
+  x = mpc_parse_input(i, l->root, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 /*
 ** Building a Parser
 */
@@ -1358,6 +2048,19 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_LEXEME:
+      mpc_undefine_unretained(p->data.lexeme.x, 0);
+      free(p->data.lexeme.k);
+      free(p->data.lexeme.firsts);
+      break;
+    
+    case MPC_TYPE_RECOVER:
+      mpc_undefine_unretained(p->data.recover.x, 0);
+      free(p->data.recover.o);
+      free(p->data.recover.c);
+      free(p->data.recover.q);
+      break;
+    
     default: break;
   }
   
@@ -1471,6 +2174,28 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       }
     break;
     
+    case MPC_TYPE_LEXEME:
+      p->data.lexeme.x = mpc_copy(a->data.lexeme.x);
+      p->data.lexeme.k = malloc(strlen(a->data.lexeme.k)+1);
+      strcpy(p->data.lexeme.k, a->data.lexeme.k);
+      p->data.lexeme.firsts = NULL;
+      if (a->data.lexeme.firsts) {
+        p->data.lexeme.firsts = malloc(256);
+        memcpy(p->data.lexeme.firsts, a->data.lexeme.firsts, 256);
+      }
+      break;
+    
+    case MPC_TYPE_RECOVER:
+      p->data.recover.x = mpc_copy(a->data.recover.x);
+      p->data.recover.o = malloc(strlen(a->data.recover.o)+1);
+      strcpy(p->data.recover.o, a->data.recover.o);
+      p->data.recover.c = malloc(strlen(a->data.recover.c)+1);
+      strcpy(p->data.recover.c, a->data.recover.c);
+      p->data.recover.q = malloc(strlen(a->data.recover.q)+1);
+      strcpy(p->data.recover.q, a->data.recover.q);
+      p->data.recover.esc = a->data.recover.esc;
+      break;
+    
     default: break;
   }
 
@@ -1952,6 +2677,29 @@ mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_
 mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
 mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
 
+/*
+** Lexer Parsers
+*/
+
+static mpc_parser_t *mpc_lexeme_strip(mpc_parser_t *a, const char *k, int strip) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LEXEME;
+  p->data.lexeme.x = a;
+  p->data.lexeme.k = malloc(strlen(k) + 1);
+  strcpy(p->data.lexeme.k, k);
+  p->data.lexeme.strip = strip;
+  p->data.lexeme.firsts = calloc(1, 256);
+  p->data.lexeme.lexable = !mpc_firsts(a, p->data.lexeme.firsts);
+  if (!p->data.lexeme.lexable) {
+    free(p->data.lexeme.firsts);
+    p->data.lexeme.firsts = NULL;
+  }
+  return p;
+}
+
+mpc_parser_t *mpc_lexeme(mpc_parser_t *a, const char *k) { return mpc_lexeme_strip(a, k, 0); }
+mpc_parser_t *mpc_tok_lexeme(mpc_parser_t *a, const char *k) { return mpc_lexeme_strip(a, k, 1); }
+
 /*
 ** Regular Expression Parsers
 */
@@ -2588,6 +3336,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     printf(")");
   }
   
+  if (p->type == MPC_TYPE_LEXEME)  { mpc_print_unretained(p->data.lexeme.x, 0); }
+  if (p->type == MPC_TYPE_RECOVER) { mpc_print_unretained(p->data.recover.x, 0); printf("~"); }
+  
 }
 
 void mpc_print(mpc_parser_t *p) {
@@ -2855,140 +3606,137 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   return NULL;
 }
 
-mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
-                                       mpc_ast_trav_order_t order)
-{
-  mpc_ast_trav_t *trav, *n_trav;
-  mpc_ast_t *cnode = ast;
-
-  /* Create the traversal structure */
-  trav = malloc(sizeof(mpc_ast_trav_t));
-  trav->curr_node = cnode;
-  trav->parent = NULL;
-  trav->curr_child = 0;
-  trav->order = order;
-
-  /* Get start node */
-  switch(order) {
-    case mpc_ast_trav_order_pre:
-      /* Nothing else is needed for pre order start */
-      break;
-
-    case mpc_ast_trav_order_post:
-      while(cnode->children_num > 0) {
-        cnode = cnode->children[0];
+/*
+** Traversal keeps one frame per level of the
+** tree in a single array, so walking the tree
+** allocates nothing per node. The top frame is
+** the current node and the index of the next
+** child to visit.
+*/
 
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-        n_trav->curr_node = cnode;
-        n_trav->parent = trav;
-        n_trav->curr_child = 0;
-        n_trav->order = order;
+enum {
+  MPC_AST_TRAV_FRAMES_MIN = 16
+};
 
-        trav = n_trav;
-      }
+static void mpc_ast_traverse_push(mpc_ast_trav_t *trav, mpc_ast_t *node) {
+  
+  mpc_ast_trav_frame_t *frames;
+  
+  if (trav->frames_num == trav->frames_slots) {
+    trav->frames_slots = trav->frames_slots < MPC_AST_TRAV_FRAMES_MIN ?
+      MPC_AST_TRAV_FRAMES_MIN : trav->frames_slots * 2;
+    if (trav->frames_owned || trav->frames == NULL) {
+      trav->frames = realloc(trav->frames, sizeof(mpc_ast_trav_frame_t) * trav->frames_slots);
+      trav->frames_owned = 1;
+    } else {
+      frames = malloc(sizeof(mpc_ast_trav_frame_t) * trav->frames_slots);
+      memcpy(frames, trav->frames, sizeof(mpc_ast_trav_frame_t) * trav->frames_num);
+      trav->frames = frames;
+      trav->frames_owned = 1;
+    }
+  }
+  
+  trav->frames[trav->frames_num].node = node;
+  trav->frames[trav->frames_num].child = 0;
+  trav->frames_num++;
+}
 
-      break;
+static void mpc_ast_traverse_descend(mpc_ast_trav_t *trav) {
+  mpc_ast_trav_frame_t *top = &trav->frames[trav->frames_num-1];
+  while (top->node->children_num > 0) {
+    mpc_ast_traverse_push(trav, top->node->children[top->child]);
+    top = &trav->frames[trav->frames_num-1];
+  }
+}
 
-    default:
-      /* Unreachable, but compiler complaints */
-      break;
+void mpc_ast_traverse_init(mpc_ast_trav_t *trav, mpc_ast_t *ast,
+                           mpc_ast_trav_order_t order,
+                           mpc_ast_trav_frame_t *frames, int frames_slots)
+{
+  trav->order = order;
+  trav->frames_num = 0;
+  trav->frames_slots = frames_slots;
+  trav->frames_owned = 0;
+  trav->self_owned = 0;
+  trav->frames = frames;
+  
+  mpc_ast_traverse_push(trav, ast);
+  
+  /* Post order starts at the leftmost leaf */
+  if (order == mpc_ast_trav_order_post) {
+    mpc_ast_traverse_descend(trav);
   }
+}
 
+mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
+                                       mpc_ast_trav_order_t order)
+{
+  mpc_ast_trav_t *trav = malloc(sizeof(mpc_ast_trav_t));
+  mpc_ast_traverse_init(trav, ast, order, NULL, 0);
+  trav->self_owned = 1;
   return trav;
 }
 
 mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav, *to_free;
-  mpc_ast_t *ret = NULL;
-  int cchild;
+  
+  mpc_ast_trav_t *t = *trav;
+  mpc_ast_trav_frame_t *top;
+  mpc_ast_t *ret;
 
   /* The end of traversal was reached */
-  if(*trav == NULL) return NULL;
+  if (t == NULL) { return NULL; }
+  
+  top = &t->frames[t->frames_num-1];
+  ret = top->node;
 
-  switch((*trav)->order) {
+  switch (t->order) {
     case mpc_ast_trav_order_pre:
-      ret = (*trav)->curr_node;
-
+      
       /* If there aren't any more children, go up */
-      while(*trav != NULL &&
-        (*trav)->curr_child >= (*trav)->curr_node->children_num)
-      {
-        to_free = *trav;
-        *trav = (*trav)->parent;
-        free(to_free);
-      }
-
-      /* If trav is NULL, the end was reached */
-      if(*trav == NULL) {
-        break;
+      while (t->frames_num > 0 && top->child >= top->node->children_num) {
+        t->frames_num--;
+        top--;
       }
-
+      
       /* Go to next child */
-      n_trav = malloc(sizeof(mpc_ast_trav_t));
-
-      cchild = (*trav)->curr_child;
-      n_trav->curr_node = (*trav)->curr_node->children[cchild];
-      n_trav->parent = *trav;
-      n_trav->curr_child = 0;
-      n_trav->order = (*trav)->order;
-
-      (*trav)->curr_child++;
-      *trav = n_trav;
-
+      if (t->frames_num > 0) {
+        top->child++;
+        mpc_ast_traverse_push(t, top->node->children[top->child-1]);
+      }
+      
       break;
 
     case mpc_ast_trav_order_post:
-      ret = (*trav)->curr_node;
-
-      /* Move up tree to the parent If the parent doesn't have any more nodes,
-       * then this is the current node. If it does, move down to its left most
-       * child. Also, free the previous traversal node */
-      to_free = *trav;
-      *trav = (*trav)->parent;
-      free(to_free);
-
-      if(*trav == NULL)
-        break;
-
-      /* Next child */
-      (*trav)->curr_child++;
-
-      /* If there aren't any more children, this is the next node */
-      if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
-        break;
-      }
-
-      /* If there are still more children, find the leftmost child from this
-       * node */
-      while((*trav)->curr_node->children_num > 0) {
-        n_trav = malloc(sizeof(mpc_ast_trav_t));
-
-        cchild = (*trav)->curr_child;
-        n_trav->curr_node = (*trav)->curr_node->children[cchild];
-        n_trav->parent = *trav;
-        n_trav->curr_child = 0;
-        n_trav->order = (*trav)->order;
-
-        *trav = n_trav;
+      
+      /* Move up to the parent. If it has no more children it is the next
+       * node, otherwise move down to the leftmost leaf of its next child */
+      t->frames_num--;
+      top--;
+      
+      if (t->frames_num > 0) {
+        top->child++;
+        if (top->child < top->node->children_num) {
+          mpc_ast_traverse_descend(t);
+        }
       }
+      
+      break;
 
     default:
       /* Unreachable, but compiler complaints */
       break;
   }
+  
+  if (t->frames_num == 0) { mpc_ast_traverse_free(trav); }
 
   return ret;
 }
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
-  mpc_ast_trav_t *n_trav;
-
-  /* Go through parents until all are free */
-  while(*trav != NULL) {
-      n_trav = (*trav)->parent;
-      free(*trav);
-      *trav = n_trav;
-  }
+  if (*trav == NULL) { return; }
+  if ((*trav)->frames_owned) { free((*trav)->frames); }
+  if ((*trav)->self_owned) { free(*trav); }
+  *trav = NULL;
 }
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
@@ -3114,6 +3862,85 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+mpc_parser_t *mpca_recover(mpc_parser_t *a, const char *o, const char *c, const char *q, char esc) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RECOVER;
+  p->data.recover.x = a;
+  p->data.recover.o = malloc(strlen(o) + 1);
+  strcpy(p->data.recover.o, o);
+  p->data.recover.c = malloc(strlen(c) + 1);
+  strcpy(p->data.recover.c, c);
+  p->data.recover.q = malloc(strlen(q) + 1);
+  strcpy(p->data.recover.q, q);
+  p->data.recover.esc = esc;
+  return p;
+}
+
+/*
+** Visiting
+*/
+
+static int mpca_visit_input(mpc_input_t *i, mpc_parser_t *p, mpca_visitor_t *v, void *d, mpc_result_t *r) {
+  
+  int j;
+  long pos = -1;
+  mpc_event_t *ev;
+  const char *tag = p->name ? p->name : ">";
+  
+  i->visit = 1;
+  mpc_input_event(i, MPC_EVENT_ENTER, tag);
+  
+  if (!mpc_parse_input(i, p, r)) { return 0; }
+  
+  mpc_ast_delete(r->output);
+  r->output = NULL;
+  
+  mpc_input_event(i, MPC_EVENT_LEAVE, tag);
+  
+  for (j = 0; j < i->events_num; j++) {
+    ev = &i->events[j];
+    if (ev->type == MPC_EVENT_STATE) { pos = ev->pos; continue; }
+    if (pos < 0) { pos = ev->pos; }
+    switch (ev->type) {
+      case MPC_EVENT_ENTER:
+        if (v->enter) { v->enter(d, ev->tag, mpc_input_state_at(i, pos)); }
+        break;
+      case MPC_EVENT_LEAVE:
+        if (v->leave) { v->leave(d, ev->tag); }
+        break;
+      case MPC_EVENT_TERMINAL:
+        if (v->terminal) { v->terminal(d, ev->tag, i->text + ev->text, mpc_input_state_at(i, pos)); }
+        break;
+      default: break;
+    }
+    pos = -1;
+  }
+  
+  return 1;
+}
+
+int mpca_visit(const char *filename, const char *string, mpc_parser_t *p, mpca_visitor_t *v, void *d, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpca_visit_input(i, p, v, d, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpca_lex_visit(const char *filename, const char *string, mpc_lexer_t *l, mpca_visitor_t *v, void *d, mpc_result_t *r) {
+  return mpca_lex_visit_at(filename, 0, string, l, v, d, r);
+}
+
+int mpca_lex_visit_at(const char *filename, long row, const char *string, mpc_lexer_t *l, mpca_visitor_t *v, void *d, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->row = row;
+  mpc_input_lex(i, l);
+  x = mpca_visit_input(i, l->root, v, d, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 /*
 ** Grammar Parser
 */
@@ -3193,26 +4020,51 @@ static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
   return mpca_count(num, xs[0]);
 }
 
+/*
+** With `MPCA_LANG_LEXER` terminals are built as
+** lexemes keyed by how they are written in the
+** grammar, so identical terminals in different
+** rules share a single token type.
+*/
+
+static mpc_parser_t *mpcaf_grammar_terminal(mpca_grammar_st_t *st, mpc_parser_t *p, const char *x, char d) {
+  
+  char *k;
+  
+  if (!(st->flags & MPCA_LANG_LEXER)) {
+    return (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? p : mpc_tok(p);
+  }
+  
+  k = malloc(strlen(x) + 3);
+  sprintf(k, "%c%s%c", d, x, d);
+  p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_lexeme(p, k) : mpc_tok_lexeme(p, k);
+  free(k);
+  return p;
+}
+
 static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  char *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  mpc_parser_t *p = mpcaf_grammar_terminal(st, mpc_string(y), x, '"');
+  free(x);
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  char *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  mpc_parser_t *p = mpcaf_grammar_terminal(st, mpc_char(y[0]), x, '\'');
+  free(x);
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape_regex(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  char *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  mpc_parser_t *p = mpcaf_grammar_terminal(st, mpc_re(y), x, '/');
+  free(x);
   free(y);
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
@@ -3630,6 +4482,9 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  
+  if (p->type == MPC_TYPE_LEXEME)  { return 1 + mpc_nodecount_unretained(p->data.lexeme.x, 0); }
+  if (p->type == MPC_TYPE_RECOVER) { return 1 + mpc_nodecount_unretained(p->data.recover.x, 0); }
 
   if (p->type == MPC_TYPE_OR) { 
     total = 0;
@@ -3675,6 +4530,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_LEXEME)   { mpc_optimise_unretained(p->data.lexeme.x, 0); }
+  if (p->type == MPC_TYPE_RECOVER)  { mpc_optimise_unretained(p->data.recover.x, 0); }
   
   if (p->type == MPC_TYPE_OR) { 
     for(i = 0; i < p->data.or.n; i++) {
@@ -211,6 +211,21 @@ mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad);
 mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad);
 mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad);
 
+/*
+** Lexer
+*/
+
+struct mpc_lexer_t;
+typedef struct mpc_lexer_t mpc_lexer_t;
+
+mpc_parser_t *mpc_lexeme(mpc_parser_t *a, const char *k);
+mpc_parser_t *mpc_tok_lexeme(mpc_parser_t *a, const char *k);
+
+mpc_lexer_t *mpc_lexer_new(mpc_parser_t *p);
+void mpc_lexer_delete(mpc_lexer_t *l);
+
+int mpc_lex_parse(const char *filename, const char *string, mpc_lexer_t *l, mpc_result_t *r);
+
 /*
 ** Common Function Parameters
 */
@@ -292,16 +307,32 @@ typedef enum {
   mpc_ast_trav_order_post
 } mpc_ast_trav_order_t;
 
+typedef struct {
+  mpc_ast_t *node;
+  int        child;
+} mpc_ast_trav_frame_t;
+
 typedef struct mpc_ast_trav_t {
-  mpc_ast_t             *curr_node;
-  struct mpc_ast_trav_t *parent;
-  int                    curr_child;
-  mpc_ast_trav_order_t   order;
+  mpc_ast_trav_order_t  order;
+  int                   frames_num;
+  int                   frames_slots;
+  int                   frames_owned;
+  int                   self_owned;
+  mpc_ast_trav_frame_t *frames;
 } mpc_ast_trav_t;
 
 mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
                                        mpc_ast_trav_order_t order);
 
+/*
+** Starts a traversal in caller owned memory. The
+** frames buffer is used until it runs out and is
+** only replaced by a heap copy for deeper trees.
+*/
+void mpc_ast_traverse_init(mpc_ast_trav_t *trav, mpc_ast_t *ast,
+                           mpc_ast_trav_order_t order,
+                           mpc_ast_trav_frame_t *frames, int frames_slots);
+
 mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
@@ -321,6 +352,47 @@ mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
 
+/*
+** `mpca_recover` never fails before the end of
+** input. On a syntax error it produces an "error"
+** node holding the message and skips the broken
+** form, using the opening and closing delimiters
+** in `o` and `c`, so that one parse reports every
+** error. Strings open and close with one of the
+** quotes in `q`, and inside them `esc` (or '\0'
+** for none) escapes the next character, so they
+** are stepped over whole. It is meant for the top
+** level of a grammar, where only the end of input
+** follows.
+*/
+
+mpc_parser_t *mpca_recover(mpc_parser_t *a, const char *o, const char *c, const char *q, char esc);
+
+/*
+** Visiting walks the parse of an `mpca` grammar
+** as enter, leave and terminal events without
+** building an `mpc_ast_t`. The strings passed to
+** the callbacks are only valid for the duration
+** of the call. On success `r->output` is NULL.
+*/
+
+typedef struct {
+  void(*enter)(void *d, const char *tag, mpc_state_t s);
+  void(*leave)(void *d, const char *tag);
+  void(*terminal)(void *d, const char *tag, const char *contents, mpc_state_t s);
+} mpca_visitor_t;
+
+int mpca_visit(const char *filename, const char *string, mpc_parser_t *p, mpca_visitor_t *v, void *d, mpc_result_t *r);
+int mpca_lex_visit(const char *filename, const char *string, mpc_lexer_t *l, mpca_visitor_t *v, void *d, mpc_result_t *r);
+
+/*
+** `mpca_lex_visit_at` parses a string taken from
+** the middle of a file. Rows in events and errors
+** count from `row`, the line the string starts on.
+*/
+
+int mpca_lex_visit_at(const char *filename, long row, const char *string, mpc_lexer_t *l, mpca_visitor_t *v, void *d, mpc_result_t *r);
+
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
 
@@ -334,7 +406,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_LEXER                = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);